@@ -5,14 +5,1144 @@
 #include "Level.h"
 #include "Misc.h"
 
-void FastSim::FastSimValve::sim()
-{
-    valve.sim(adj);
+#include <mutex>
+#include <map>
+
+#ifdef FAST_SIM_AVX2
+#include <immintrin.h>
+#endif
+
+static FastSim::Kernel detect_kernel()
+{
+#ifdef FAST_SIM_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return FastSim::KERNEL_AVX2;
+#endif
+    return FastSim::KERNEL_SCALAR;
+}
+
+FastSim::Kernel FastSim::kernel = detect_kernel();
+bool FastSim::track_activity = false;
+bool FastSim::freeze_components = true;
+std::atomic<uint64_t> FastSim::total_element_count = 0;
+std::atomic<uint64_t> FastSim::total_element_skipped = 0;
+bool FastSim::profile = false;
+
+void FastSim::Extras::clear()
+{
+    pipe2_lanes.clear();
+    pipe3_lanes.clear();
+    pipe4_lanes.clear();
+    valve_lanes.clear();
+    node_element_start.clear();
+    node_elements.clear();
+    element_stamp.clear();
+    active.clear();
+    next_active.clear();
+    untracked_ticks = 0;
+    profile_scopes.clear();
+    profile_node_scope.clear();
+    profile_elements.clear();
+    profile_scope = 0;
+}
+
+uint32_t FastSim::node(CircuitPressure& pres)
+{
+    uint32_t instance = 0;
+    if (!instances.empty())
+    {
+        Instance& inst = instances.back();
+        for (int i = 0; i < 4; i++)
+            if (inst.pins[i] == &pres)
+                return inst.pin_nodes[i];
+        instance = inst.id;
+    }
+    NodeKey key = {&pres, instance};
+    auto it = node_map.find(key);
+    if (it != node_map.end())
+        return it->second;
+    uint32_t index = node_pressure.size();
+    node_map[key] = index;
+    node_pressure.push_back(&pres);
+    node_type.push_back(&pres == &null_pressure ? NODE_TYPE_NULL : NODE_TYPE_EXTERNAL);
+    node_shared.push_back(instance);
+    if (profiling())
+        extras->profile_node_scope.push_back(extras->profile_scope);
+    return index;
 }
 
 void FastSim::add_valve(CircuitElementValve& valve, PressureAdjacent adj)
 {
-    valves.push_back(FastSimValve(valve, adj));
+    valves.push_back(FastSimValve(node(adj.N), node(adj.E), node(adj.S), node(adj.W)));
+    profile_add(PROFILE_VALVE);
+}
+
+// Starts a new copy of a shared subcircuit. Its pins are looked up in the enclosing circuit
+// first, everything else gets a node of its own until leave_instance.
+
+void FastSim::enter_instance(PressureAdjacent adj)
+{
+    Instance inst;
+    CircuitPressure* pins[4] = {&adj.N, &adj.E, &adj.S, &adj.W};
+    for (int i = 0; i < 4; i++)
+    {
+        inst.pins[i] = pins[i];
+        inst.pin_nodes[i] = node(*pins[i]);
+    }
+    inst.id = ++instance_count;
+    instances.push_back(inst);
+}
+
+// Turns what a single cell added to an empty sim into a fragment. The sides of the cell become
+// pins, so the fragment can be linked in wherever the cell ends up.
+
+void FastSim::record_fragment(Fragment& fragment, PressureAdjacent adj)
+{
+    CircuitPressure* pins[Fragment::PIN_COUNT] = {&adj.N, &adj.E, &adj.S, &adj.W, &null_pressure};
+    fragment.nodes = node_pressure;
+    fragment.node_kind.resize(node_pressure.size());
+    for (uint32_t i = 0; i < node_pressure.size(); i++)
+    {
+        fragment.node_kind[i] = (Fragment::PIN_COUNT + int(node_type[i])) | (node_shared[i] ? Fragment::SHARED : 0);
+        for (int p = 0; p < Fragment::PIN_COUNT; p++)
+            if (node_pressure[i] == pins[p])
+                fragment.node_kind[i] = p;
+    }
+    fragment.pipe2.clear();
+    for (FastSimPipe2& p : pipe2)
+        fragment.pipe2.insert(fragment.pipe2.end(), {p.a, p.b});
+    fragment.pipe3.clear();
+    for (FastSimPipe3& p : pipe3)
+        fragment.pipe3.insert(fragment.pipe3.end(), {p.a, p.b, p.c});
+    fragment.pipe4.clear();
+    for (FastSimPipe4& p : pipe4)
+        fragment.pipe4.insert(fragment.pipe4.end(), {p.a, p.b, p.c, p.d});
+    fragment.valves.clear();
+    for (FastSimValve& v : valves)
+        fragment.valves.insert(fragment.valves.end(), {v.n, v.e, v.s, v.w});
+    fragment.sources = sources;
+}
+
+// Links a fragment in as if the cell had been walked here. Nodes are created in the same order
+// the walk would have, so the compiled layout, and with it the signature, is the same either way.
+
+void FastSim::add_fragment(const Fragment& fragment, PressureAdjacent adj)
+{
+    if (fragment.nodes.empty())
+        return;
+    CircuitPressure* pins[Fragment::PIN_COUNT] = {&adj.N, &adj.E, &adj.S, &adj.W, &null_pressure};
+    std::vector<uint32_t>& local = fragment_local;
+    local.resize(fragment.nodes.size());
+    for (uint32_t i = 0; i < fragment.nodes.size(); i++)
+    {
+        uint8_t kind = fragment.node_kind[i];
+        if (kind < Fragment::PIN_COUNT)
+        {
+            local[i] = node(*pins[kind]);
+            continue;
+        }
+        local[i] = node_pressure.size();
+        node_pressure.push_back(fragment.nodes[i]);
+        node_type.push_back(NodeType((kind & ~Fragment::SHARED) - Fragment::PIN_COUNT));
+        node_shared.push_back(kind & Fragment::SHARED);
+    }
+    const std::vector<uint32_t>& f2 = fragment.pipe2;
+    for (size_t i = 0; i < f2.size(); i += 2)
+        pipe2.push_back(FastSimPipe2(local[f2[i]], local[f2[i + 1]]));
+    const std::vector<uint32_t>& f3 = fragment.pipe3;
+    for (size_t i = 0; i < f3.size(); i += 3)
+        pipe3.push_back(FastSimPipe3(local[f3[i]], local[f3[i + 1]], local[f3[i + 2]]));
+    const std::vector<uint32_t>& f4 = fragment.pipe4;
+    for (size_t i = 0; i < f4.size(); i += 4)
+        pipe4.push_back(FastSimPipe4(local[f4[i]], local[f4[i + 1]], local[f4[i + 2]], local[f4[i + 3]]));
+    const std::vector<uint32_t>& fv = fragment.valves;
+    for (size_t i = 0; i < fv.size(); i += 4)
+        valves.push_back(FastSimValve(local[fv[i]], local[fv[i + 1]], local[fv[i + 2]], local[fv[i + 3]]));
+    for (uint32_t n : fragment.sources)
+        sources.push_back(local[n]);
+}
+
+// Splits the nodes into connected components. The null node is left out, as it links pins which
+// have nothing to do with each other. A component with no port or source can only hold the
+// pressure it starts with, so if that is zero everywhere it will stay zero and it is frozen.
+
+void FastSim::find_components(std::vector<uint32_t>& component)
+{
+    uint32_t count = node_pressure.size();
+    std::vector<uint32_t> parent(count);
+    for (uint32_t i = 0; i < count; i++)
+        parent[i] = i;
+    auto find = [&](uint32_t i)
+    {
+        while (parent[i] != i)
+        {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    };
+    auto join = [&](std::initializer_list<uint32_t> nodes)
+    {
+        uint32_t first = NO_COMPONENT;
+        for (uint32_t i : nodes)
+        {
+            if (node_type[i] == NODE_TYPE_NULL)
+                continue;
+            if (first == NO_COMPONENT)
+                first = find(i);
+            else
+                parent[find(i)] = first;
+        }
+    };
+
+    for (FastSimPipe2& p : pipe2)
+        join({p.a, p.b});
+    for (FastSimPipe3& p : pipe3)
+        join({p.a, p.b, p.c});
+    for (FastSimPipe4& p : pipe4)
+        join({p.a, p.b, p.c, p.d});
+    for (FastSimValve& p : valves)
+        join({p.n, p.e, p.s, p.w});
+
+    std::vector<uint32_t> root_component(count, NO_COMPONENT);
+    component.assign(count, NO_COMPONENT);
+    component_nodes.clear();
+    component_frozen.clear();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (node_type[i] == NODE_TYPE_NULL)
+            continue;
+        uint32_t root = find(i);
+        if (root_component[root] == NO_COMPONENT)
+        {
+            root_component[root] = component_nodes.size();
+            component_nodes.push_back(0);
+            component_frozen.push_back(freeze_components);
+        }
+        uint32_t c = root_component[root];
+        component[i] = c;
+        component_nodes[c]++;
+        if (node_type[i] == NODE_TYPE_EXTERNAL || (!node_shared[i] && node_pressure[i]->value))
+            component_frozen[c] = false;
+    }
+    for (uint32_t i : sources)
+        component_frozen[component[i]] = false;
+}
+
+// Shared nodes start from zero, which is only right after a reset. Shared subcircuits are only
+// used by headless scoring, which never edits a circuit, so it only preps after LevelSet::reset.
+
+void FastSim::compile()
+{
+    assert(!ticked || std::find(node_shared.begin(), node_shared.end(), true) == node_shared.end());
+    uint32_t count = node_pressure.size();
+    uint32_t type_start[NODE_TYPE_COUNT + 1] = {0};
+    for (NodeType t : node_type)
+        type_start[t + 1]++;
+    for (int t = 0; t < NODE_TYPE_COUNT; t++)
+        type_start[t + 1] += type_start[t];
+    internal_count = type_start[NODE_TYPE_VENTED];
+    vented_end = type_start[NODE_TYPE_EXTERNAL];
+    external_end = type_start[NODE_TYPE_NULL];
+
+    std::vector<uint32_t> component;
+    find_components(component);
+    if (profiling())
+        profile_compile(component);
+
+    // Nodes of a component are kept together within each type, so each component touches a
+    // compact part of the arrays
+
+    std::vector<uint32_t> order(count);
+    for (uint32_t i = 0; i < count; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+    {
+        if (node_type[a] != node_type[b])
+            return node_type[a] < node_type[b];
+        return component[a] < component[b];
+    });
+
+    std::vector<uint32_t> remap(count);
+    std::vector<CircuitPressure*> new_pressure(count);
+    std::vector<NodeType> new_type(count);
+    std::vector<bool> new_shared(count);
+    std::vector<uint32_t> new_component(count);
+    for (uint32_t j = 0; j < count; j++)
+    {
+        uint32_t i = order[j];
+        remap[i] = j;
+        new_pressure[j] = node_pressure[i];
+        new_type[j] = node_type[i];
+        new_shared[j] = node_shared[i];
+        new_component[j] = component[i];
+    }
+    node_pressure.swap(new_pressure);
+    node_type.swap(new_type);
+    node_shared.swap(new_shared);
+    node_component.swap(new_component);
+    node_map.clear();
+
+    for (FastSimPipe2& p : pipe2)
+    {
+        p.a = remap[p.a];
+        p.b = remap[p.b];
+    }
+    for (FastSimPipe3& p : pipe3)
+    {
+        p.a = remap[p.a];
+        p.b = remap[p.b];
+        p.c = remap[p.c];
+    }
+    for (FastSimPipe4& p : pipe4)
+    {
+        p.a = remap[p.a];
+        p.b = remap[p.b];
+        p.c = remap[p.c];
+        p.d = remap[p.d];
+    }
+    for (FastSimValve& p : valves)
+    {
+        p.n = remap[p.n];
+        p.e = remap[p.e];
+        p.s = remap[p.s];
+        p.w = remap[p.w];
+    }
+    for (uint32_t& s : sources)
+        s = remap[s];
+
+    // Elements of frozen components can never move any pressure, the rest are grouped by component
+
+    auto frozen = [&](std::initializer_list<uint32_t> nodes)
+    {
+        for (uint32_t i : nodes)
+            if (node_component[i] != NO_COMPONENT && !component_frozen[node_component[i]])
+                return false;
+        return true;
+    };
+    auto by_component = [&](uint32_t a, uint32_t b) {return node_component[a] < node_component[b];};
+    pipe2.erase(std::remove_if(pipe2.begin(), pipe2.end(), [&](FastSimPipe2& p) {return frozen({p.a, p.b});}), pipe2.end());
+    pipe3.erase(std::remove_if(pipe3.begin(), pipe3.end(), [&](FastSimPipe3& p) {return frozen({p.a, p.b, p.c});}), pipe3.end());
+    pipe4.erase(std::remove_if(pipe4.begin(), pipe4.end(), [&](FastSimPipe4& p) {return frozen({p.a, p.b, p.c, p.d});}), pipe4.end());
+    valves.erase(std::remove_if(valves.begin(), valves.end(), [&](FastSimValve& p) {return frozen({p.n, p.e, p.s, p.w});}), valves.end());
+    std::stable_sort(pipe2.begin(), pipe2.end(), [&](const FastSimPipe2& p, const FastSimPipe2& q) {return by_component(p.a, q.a);});
+    std::stable_sort(pipe3.begin(), pipe3.end(), [&](const FastSimPipe3& p, const FastSimPipe3& q) {return by_component(p.a, q.a);});
+    std::stable_sort(pipe4.begin(), pipe4.end(), [&](const FastSimPipe4& p, const FastSimPipe4& q) {return by_component(p.a, q.a);});
+
+    // The AVX2 kernel gathers the nodes of 8 elements at a time
+
+    vectorized = kernel == KERNEL_AVX2;
+    if (vectorized)
+    {
+        get_extras();
+        extras->pipe2_lanes.resize((pipe2.size() / 8) * 16);
+        for (uint32_t i = 0; i < extras->pipe2_lanes.size() / 2; i++)
+        {
+            uint32_t* block = &extras->pipe2_lanes[(i / 8) * 16 + i % 8];
+            block[0] = pipe2[i].a;
+            block[8] = pipe2[i].b;
+        }
+        extras->pipe3_lanes.resize((pipe3.size() / 8) * 24);
+        for (uint32_t i = 0; i < extras->pipe3_lanes.size() / 3; i++)
+        {
+            uint32_t* block = &extras->pipe3_lanes[(i / 8) * 24 + i % 8];
+            block[0] = pipe3[i].a;
+            block[8] = pipe3[i].b;
+            block[16] = pipe3[i].c;
+        }
+        extras->pipe4_lanes.resize((pipe4.size() / 8) * 32);
+        for (uint32_t i = 0; i < extras->pipe4_lanes.size() / 4; i++)
+        {
+            uint32_t* block = &extras->pipe4_lanes[(i / 8) * 32 + i % 8];
+            block[0] = pipe4[i].a;
+            block[8] = pipe4[i].b;
+            block[16] = pipe4[i].c;
+            block[24] = pipe4[i].d;
+        }
+        extras->valve_lanes.resize((valves.size() / 8) * 32);
+        for (uint32_t i = 0; i < extras->valve_lanes.size() / 4; i++)
+        {
+            uint32_t* block = &extras->valve_lanes[(i / 8) * 32 + i % 8];
+            block[0] = valves[i].n;
+            block[8] = valves[i].e;
+            block[16] = valves[i].s;
+            block[24] = valves[i].w;
+        }
+    }
+
+    value.resize(count);
+    move_next.assign(count, 0);
+    for (uint32_t i = 0; i < count; i++)
+        value[i] = (i < external_end && !node_shared[i]) ? node_pressure[i]->value : 0;
+
+    compute_signature();
+    if (track_activity)
+        compile_activity();
+}
+
+// Profiling follows the walk into each subcircuit cell. Nodes and elements are charged to the
+// subcircuit they were added in, and every tick of the compiled sim charges them again. Cost is
+// counted in flows, the pairs of nodes an element moves pressure between each tick, and only for
+// elements that survive compile. Totals from every sim are gathered by path and by level, so
+// subcircuits used across many designs show up together.
+
+class ProfileTotal
+{
+public:
+    uint64_t instances = 0;
+    uint64_t node_ticks = 0;
+    uint64_t flow_ticks = 0;
+};
+
+static std::mutex profile_mutex;
+static ProfileTotal profile_total;
+static std::map<std::string, ProfileTotal> profile_paths;
+static std::map<std::pair<int, bool>, ProfileTotal> profile_levels;
+
+void FastSim::profile_enter(XYPos pos, int level_index, bool custom, PressureAdjacent adj)
+{
+    ProfileScope scope;
+    scope.parent = extras->profile_scope;
+    scope.pos = pos;
+    scope.level_index = level_index;
+    scope.custom = custom;
+    scope.node_start = node_pressure.size();
+    CircuitPressure* pins[4] = {&adj.N, &adj.E, &adj.S, &adj.W};
+    std::copy(pins, pins + 4, scope.pins);
+    extras->profile_scope = extras->profile_scopes.size();
+    extras->profile_scopes.push_back(scope);
+}
+
+void FastSim::profile_leave()
+{
+    ProfileScope& scope = extras->profile_scopes[extras->profile_scope];
+    for (uint32_t i = scope.node_start; i < node_pressure.size(); i++)
+        if (extras->profile_node_scope[i] == extras->profile_scope && std::find(scope.pins, scope.pins + 4, node_pressure[i]) != scope.pins + 4)
+            extras->profile_node_scope[i] = scope.parent;
+    extras->profile_scope = scope.parent;
+}
+
+void FastSim::profile_compile(const std::vector<uint32_t>& component)
+{
+    if (extras->profile_node_scope.size() != node_pressure.size())     // linked from fragments, there is nothing to go on
+        return;
+    auto live = [&](uint32_t i) {return component[i] != NO_COMPONENT && !component_frozen[component[i]];};
+    for (uint32_t i = 0; i < node_pressure.size(); i++)
+        if (node_type[i] != NODE_TYPE_NULL)
+            extras->profile_scopes[extras->profile_node_scope[i]].nodes++;
+
+    uint32_t next[PROFILE_SOURCE + 1] = {};
+    for (ProfileElement& e : extras->profile_elements)
+    {
+        uint32_t i = next[e.kind]++;
+        bool moving = false;
+        uint64_t flows = 1;
+        switch (e.kind)
+        {
+            case PROFILE_PIPE2:
+                moving = live(pipe2[i].a) || live(pipe2[i].b);
+                break;
+            case PROFILE_PIPE3:
+                moving = live(pipe3[i].a) || live(pipe3[i].b) || live(pipe3[i].c);
+                flows = 3;
+                break;
+            case PROFILE_PIPE4:
+                moving = live(pipe4[i].a) || live(pipe4[i].b) || live(pipe4[i].c) || live(pipe4[i].d);
+                flows = 6;
+                break;
+            case PROFILE_VALVE:
+                moving = live(valves[i].n) || live(valves[i].e) || live(valves[i].s) || live(valves[i].w);
+                break;
+            case PROFILE_SOURCE:
+                moving = true;
+                break;
+        }
+        if (moving)
+            extras->profile_scopes[e.scope].flows += flows;
+    }
+    extras->profile_elements.clear();
+}
+
+void FastSim::flush_profile()
+{
+    if (!profiling() || !ticks)
+    {
+        ticks = 0;
+        return;
+    }
+    std::vector<std::string> paths(extras->profile_scopes.size());
+    for (uint32_t i = 1; i < extras->profile_scopes.size(); i++)
+    {
+        ProfileScope& scope = extras->profile_scopes[i];
+        char label[64];
+        snprintf(label, sizeof(label), "(%d,%d) %slevel %d", scope.pos.x, scope.pos.y, scope.custom ? "custom " : "", scope.level_index);
+        paths[i] = scope.parent ? paths[scope.parent] + " / " + label : std::string(label);
+    }
+    for (uint32_t i = extras->profile_scopes.size() - 1; i > 0; i--)    // children come after their parent
+    {
+        extras->profile_scopes[extras->profile_scopes[i].parent].nodes += extras->profile_scopes[i].nodes;
+        extras->profile_scopes[extras->profile_scopes[i].parent].flows += extras->profile_scopes[i].flows;
+    }
+
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    for (uint32_t i = 0; i < extras->profile_scopes.size(); i++)
+    {
+        ProfileScope& scope = extras->profile_scopes[i];
+        ProfileTotal& total = i ? profile_paths[paths[i]] : profile_total;
+        total.instances++;
+        total.node_ticks += scope.nodes * ticks;
+        total.flow_ticks += scope.flows * ticks;
+        if (!i)
+            continue;
+        ProfileTotal& level = profile_levels[std::make_pair(scope.level_index, scope.custom)];
+        level.instances++;
+        level.node_ticks += scope.nodes * ticks;
+        level.flow_ticks += scope.flows * ticks;
+    }
+    ticks = 0;
+}
+
+// Subcircuits can nest, so a level's share includes everything inside it and the shares do not
+// add up to 100%.
+
+std::string FastSim::profile_report(unsigned max_lines)
+{
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    std::string report;
+    char line[512];
+    double nodes = std::max(profile_total.node_ticks, uint64_t(1));
+    double flows = std::max(profile_total.flow_ticks, uint64_t(1));
+    snprintf(line, sizeof(line), "profile: %llu sims, %llu node ticks, %llu flow ticks\n", (unsigned long long)profile_total.instances, (unsigned long long)profile_total.node_ticks, (unsigned long long)profile_total.flow_ticks);
+    report += line;
+
+    auto by_flows = [](const ProfileTotal& a, const ProfileTotal& b) {return a.flow_ticks > b.flow_ticks;};
+    std::vector<std::pair<std::pair<int, bool>, ProfileTotal>> levels(profile_levels.begin(), profile_levels.end());
+    std::stable_sort(levels.begin(), levels.end(), [&](auto& a, auto& b) {return by_flows(a.second, b.second);});
+    report += "by level:\n";
+    for (unsigned i = 0; i < levels.size() && i < max_lines; i++)
+    {
+        snprintf(line, sizeof(line), "  %s level %d: %llu instances, %.1f%% of nodes, %.1f%% of flows\n", levels[i].first.second ? "custom" : "library", levels[i].first.first,
+                 (unsigned long long)levels[i].second.instances, 100.0 * levels[i].second.node_ticks / nodes, 100.0 * levels[i].second.flow_ticks / flows);
+        report += line;
+    }
+
+    std::vector<std::pair<std::string, ProfileTotal>> paths(profile_paths.begin(), profile_paths.end());
+    std::stable_sort(paths.begin(), paths.end(), [&](auto& a, auto& b) {return by_flows(a.second, b.second);});
+    report += "by position:\n";
+    for (unsigned i = 0; i < paths.size() && i < max_lines; i++)
+    {
+        snprintf(line, sizeof(line), "  %s: %.1f%% of nodes, %.1f%% of flows\n", paths[i].first.c_str(), 100.0 * paths[i].second.node_ticks / nodes, 100.0 * paths[i].second.flow_ticks / flows);
+        report += line;
+    }
+    return report;
+}
+
+// FNV-1a over everything that decides how the compiled circuit behaves. Node numbering is
+// deterministic, so two compiles with equal signatures can swap states.
+
+void FastSim::compute_signature()
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&](uint32_t v)
+    {
+        hash = (hash ^ v) * 0x100000001b3ull;
+    };
+    mix(node_pressure.size());
+    mix(internal_count);
+    mix(vented_end);
+    mix(external_end);
+    mix(pipe2.size());
+    for (FastSimPipe2& p : pipe2)
+    {
+        mix(p.a);
+        mix(p.b);
+    }
+    mix(pipe3.size());
+    for (FastSimPipe3& p : pipe3)
+    {
+        mix(p.a);
+        mix(p.b);
+        mix(p.c);
+    }
+    mix(pipe4.size());
+    for (FastSimPipe4& p : pipe4)
+    {
+        mix(p.a);
+        mix(p.b);
+        mix(p.c);
+        mix(p.d);
+    }
+    mix(valves.size());
+    for (FastSimValve& p : valves)
+    {
+        mix(p.n);
+        mix(p.e);
+        mix(p.s);
+        mix(p.w);
+    }
+    mix(sources.size());
+    for (uint32_t i : sources)
+        mix(i);
+    signature = hash;
+}
+
+// Elements are numbered pipe2, pipe3, pipe4 then valves. Each node lists the elements it feeds,
+// so a change to the node can wake them up for the next tick.
+
+void FastSim::compile_activity()
+{
+    get_extras();
+    uint32_t count = node_pressure.size();
+    std::vector<std::vector<uint32_t>> elements(count);
+    uint32_t element = 0;
+    for (FastSimPipe2& p : pipe2)
+    {
+        for (uint32_t i : {p.a, p.b})
+            elements[i].push_back(element);
+        element++;
+    }
+    for (FastSimPipe3& p : pipe3)
+    {
+        for (uint32_t i : {p.a, p.b, p.c})
+            elements[i].push_back(element);
+        element++;
+    }
+    for (FastSimPipe4& p : pipe4)
+    {
+        for (uint32_t i : {p.a, p.b, p.c, p.d})
+            elements[i].push_back(element);
+        element++;
+    }
+    for (FastSimValve& p : valves)
+    {
+        for (uint32_t i : {p.n, p.e, p.s, p.w})
+            elements[i].push_back(element);
+        element++;
+    }
+
+    extras->node_element_start.assign(count + 1, 0);
+    extras->node_elements.clear();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        extras->node_elements.insert(extras->node_elements.end(), elements[i].begin(), elements[i].end());
+        extras->node_element_start[i + 1] = extras->node_elements.size();
+    }
+    extras->element_stamp.assign(element, 0);
+    extras->active.clear();
+    extras->next_active.clear();
+    extras->stamp = 0;
+    tracking = true;
+    wake_all();
+}
+
+void FastSim::wake_all()
+{
+    if (!tracking)
+        return;
+    extras->active.clear();
+    if (extras->stamp >= UINT32_MAX - 2)        // every stamp is rewritten below, so wrapping around is safe here
+        extras->stamp = 0;
+    extras->stamp++;
+    for (uint32_t e = 0; e < extras->element_stamp.size(); e++)
+    {
+        extras->element_stamp[e] = extras->stamp;
+        extras->active.push_back(e);
+    }
+}
+
+void FastSim::flush_activity()
+{
+    if (!extras)
+        return;
+    total_element_count += extras->element_count;
+    total_element_skipped += extras->element_skipped;
+    extras->element_count = 0;
+    extras->element_skipped = 0;
+}
+
+void FastSim::sim()
+{
+    ticks++;
+    ticked = true;
+    if (tracking)
+    {
+        if (!extras->untracked_ticks)
+        {
+            sim_tracked();
+            return;
+        }
+        extras->untracked_ticks--;
+        extras->element_count += extras->element_stamp.size();
+        if (!extras->untracked_ticks)
+            wake_all();
+    }
+    Pressure* val = value.data();
+    Pressure* mov = move_next.data();
+
+    for (uint32_t i = vented_end; i < external_end; i++)
+        val[i] = node_pressure[i]->value;
+    for (uint32_t i = internal_count; i < vented_end; i++)
+        mov[i] -= val[i] / 2;
+
+#ifdef FAST_SIM_AVX2
+    if (vectorized)
+    {
+        sim_pipes_avx2(val, mov);
+        sim_valves_avx2(val, mov);
+    }
+    else
+#endif
+    {
+        for (FastSimPipe2& p : pipe2)
+            p.sim(val, mov);
+        for (FastSimPipe3& p : pipe3)
+            p.sim(val, mov);
+        for (FastSimPipe4& p : pipe4)
+            p.sim(val, mov);
+        for (FastSimValve& p : valves)
+            p.sim(val, mov);
+    }
+    for (uint32_t i : sources)
+    {
+        int64_t v = (100 * PRESSURE_SCALAR - val[i]) / 2;
+        steam_used += v;
+        mov[i] += v;
+    }
+
+    for (uint32_t i = 0; i < vented_end; i++)
+    {
+        val[i] += mov[i];
+        mov[i] = 0;
+    }
+    for (uint32_t i = vented_end; i < external_end; i++)
+    {
+        node_pressure[i]->move(mov[i]);
+        mov[i] = 0;
+    }
+    for (uint32_t i = external_end; i < move_next.size(); i++)
+        mov[i] = 0;
+}
+
+// The same tick as sim(), but only elements in the active list are ticked. An element whose
+// nodes did not change computes the same moves as last tick, so if those were all zero it can
+// be left out until one of its nodes changes. Integer sums do not depend on the order in which
+// the moves are added, so the results are identical.
+
+void FastSim::sim_tracked()
+{
+    Pressure* val = value.data();
+    Pressure* mov = move_next.data();
+    uint32_t pipe3_start = pipe2.size();
+    uint32_t pipe4_start = pipe3_start + pipe3.size();
+    uint32_t valve_start = pipe4_start + pipe4.size();
+    if (extras->stamp >= UINT32_MAX - 2)
+        wake_all();
+    uint32_t next_stamp = extras->stamp + 1;
+
+    auto wake = [&](uint32_t node, uint32_t wake_stamp, std::vector<uint32_t>& list)
+    {
+        for (uint32_t j = extras->node_element_start[node]; j < extras->node_element_start[node + 1]; j++)
+        {
+            uint32_t e = extras->node_elements[j];
+            if (extras->element_stamp[e] != wake_stamp)
+            {
+                extras->element_stamp[e] = wake_stamp;
+                list.push_back(e);
+            }
+        }
+    };
+
+    for (uint32_t i = vented_end; i < external_end; i++)
+    {
+        if (val[i] != node_pressure[i]->value)
+        {
+            val[i] = node_pressure[i]->value;
+            wake(i, extras->stamp, extras->active);
+        }
+    }
+    for (uint32_t i = internal_count; i < vented_end; i++)
+        mov[i] -= val[i] / 2;
+
+    extras->next_active.clear();
+    for (uint32_t e : extras->active)
+    {
+        bool moved;
+        if (e < pipe3_start)
+            moved = pipe2[e].sim(val, mov);
+        else if (e < pipe4_start)
+            moved = pipe3[e - pipe3_start].sim(val, mov);
+        else if (e < valve_start)
+            moved = pipe4[e - pipe4_start].sim(val, mov);
+        else
+            moved = valves[e - valve_start].sim(val, mov);
+        if (moved && extras->element_stamp[e] != next_stamp)
+        {
+            extras->element_stamp[e] = next_stamp;
+            extras->next_active.push_back(e);
+        }
+    }
+    extras->element_count += extras->element_stamp.size();
+    extras->element_skipped += extras->element_stamp.size() - extras->active.size();
+
+    for (uint32_t i : sources)
+    {
+        int64_t v = (100 * PRESSURE_SCALAR - val[i]) / 2;
+        steam_used += v;
+        mov[i] += v;
+    }
+
+    for (uint32_t i = 0; i < vented_end; i++)
+    {
+        if (mov[i])
+        {
+            val[i] += mov[i];
+            mov[i] = 0;
+            wake(i, next_stamp, extras->next_active);
+        }
+    }
+    for (uint32_t i = vented_end; i < external_end; i++)
+    {
+        node_pressure[i]->move(mov[i]);
+        mov[i] = 0;
+    }
+    for (uint32_t i = external_end; i < move_next.size(); i++)
+        mov[i] = 0;
+
+    extras->active.swap(extras->next_active);
+    extras->stamp = next_stamp;
+    if (extras->active.size() * 4 > extras->element_stamp.size())
+        extras->untracked_ticks = 256;
+}
+
+#ifdef FAST_SIM_AVX2
+
+// Truncating signed division, matching what the compiler emits for the scalar "/ 2", "/ 3" and "/ 4"
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_div2(__m256i d)
+{
+    return _mm256_srai_epi32(_mm256_add_epi32(d, _mm256_srli_epi32(d, 31)), 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_div3(__m256i d)
+{
+    __m256i magic = _mm256_set1_epi32(0x55555556);
+    __m256i even = _mm256_srli_epi64(_mm256_mul_epi32(d, magic), 32);
+    __m256i odd = _mm256_mul_epi32(_mm256_srli_epi64(d, 32), magic);
+    __m256i q = _mm256_blend_epi32(even, odd, 0xAA);
+    return _mm256_sub_epi32(q, _mm256_srai_epi32(d, 31));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_div4(__m256i d)
+{
+    return _mm256_srai_epi32(_mm256_add_epi32(d, _mm256_srli_epi32(_mm256_srai_epi32(d, 31), 30)), 2);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_gather(const Pressure* value, const uint32_t* lanes)
+{
+    return _mm256_i32gather_epi32(value, _mm256_loadu_si256((const __m256i*)lanes), 4);
+}
+
+// Pipes are processed 8 at a time, the per-node sums are then added back one lane at a time
+// as nodes may be shared between lanes.
+
+__attribute__((target("avx2")))
+void FastSim::sim_pipes_avx2(const Pressure* value, Pressure* move_next)
+{
+    alignas(32) Pressure delta[4][8];
+    const uint32_t* lanes = extras->pipe2_lanes.data();
+    uint32_t blocks = pipe2.size() / 8;
+    for (uint32_t j = 0; j < blocks; j++, lanes += 16)
+    {
+        __m256i a = avx2_gather(value, lanes);
+        __m256i b = avx2_gather(value, lanes + 8);
+        _mm256_store_si256((__m256i*)delta[0], avx2_div2(_mm256_sub_epi32(a, b)));
+        for (int k = 0; k < 8; k++)
+        {
+            move_next[lanes[k]] -= delta[0][k];
+            move_next[lanes[k + 8]] += delta[0][k];
+        }
+    }
+    for (uint32_t i = blocks * 8; i < pipe2.size(); i++)
+        pipe2[i].sim(value, move_next);
+
+    lanes = extras->pipe3_lanes.data();
+    blocks = pipe3.size() / 8;
+    for (uint32_t j = 0; j < blocks; j++, lanes += 24)
+    {
+        __m256i a = avx2_gather(value, lanes);
+        __m256i b = avx2_gather(value, lanes + 8);
+        __m256i c = avx2_gather(value, lanes + 16);
+        __m256i ab = avx2_div3(_mm256_sub_epi32(a, b));
+        __m256i ac = avx2_div3(_mm256_sub_epi32(a, c));
+        __m256i bc = avx2_div3(_mm256_sub_epi32(b, c));
+        _mm256_store_si256((__m256i*)delta[0], _mm256_add_epi32(ab, ac));
+        _mm256_store_si256((__m256i*)delta[1], _mm256_sub_epi32(ab, bc));
+        _mm256_store_si256((__m256i*)delta[2], _mm256_add_epi32(ac, bc));
+        for (int k = 0; k < 8; k++)
+        {
+            move_next[lanes[k]] -= delta[0][k];
+            move_next[lanes[k + 8]] += delta[1][k];
+            move_next[lanes[k + 16]] += delta[2][k];
+        }
+    }
+    for (uint32_t i = blocks * 8; i < pipe3.size(); i++)
+        pipe3[i].sim(value, move_next);
+
+    lanes = extras->pipe4_lanes.data();
+    blocks = pipe4.size() / 8;
+    for (uint32_t j = 0; j < blocks; j++, lanes += 32)
+    {
+        __m256i a = avx2_gather(value, lanes);
+        __m256i b = avx2_gather(value, lanes + 8);
+        __m256i c = avx2_gather(value, lanes + 16);
+        __m256i d = avx2_gather(value, lanes + 24);
+        __m256i ab = avx2_div4(_mm256_sub_epi32(a, b));
+        __m256i ac = avx2_div4(_mm256_sub_epi32(a, c));
+        __m256i bc = avx2_div4(_mm256_sub_epi32(b, c));
+        __m256i ad = avx2_div4(_mm256_sub_epi32(a, d));
+        __m256i bd = avx2_div4(_mm256_sub_epi32(b, d));
+        __m256i cd = avx2_div4(_mm256_sub_epi32(c, d));
+        _mm256_store_si256((__m256i*)delta[0], _mm256_add_epi32(_mm256_add_epi32(ab, ac), ad));
+        _mm256_store_si256((__m256i*)delta[1], _mm256_sub_epi32(_mm256_sub_epi32(ab, bc), bd));
+        _mm256_store_si256((__m256i*)delta[2], _mm256_sub_epi32(_mm256_add_epi32(ac, bc), cd));
+        _mm256_store_si256((__m256i*)delta[3], _mm256_add_epi32(_mm256_add_epi32(ad, bd), cd));
+        for (int k = 0; k < 8; k++)
+        {
+            move_next[lanes[k]] -= delta[0][k];
+            move_next[lanes[k + 8]] += delta[1][k];
+            move_next[lanes[k + 16]] += delta[2][k];
+            move_next[lanes[k + 24]] += delta[3][k];
+        }
+    }
+    for (uint32_t i = blocks * 8; i < pipe4.size(); i++)
+        pipe4[i].sim(value, move_next);
+}
+
+// The valve flow is trunc(flow * open / (25 << 22)) with the product up to 62 bits, which AVX2 can
+// only multiply out four lanes at a time and has no 64 bit division or high multiply for. The
+// sign comes from the flow alone, as the opening is clamped at zero, so the magnitude is divided
+// unsigned. After the shift, v < 2^40 is exact in a double, and (v + 0.5) / 25 lies at least 0.02
+// from any integer while the reciprocal multiply is off by less than 2^-16, so truncating it gives
+// v / 25 exactly. Results wrap to 32 bits just as the scalar cast does.
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_valve_div(__m256i flow, __m256i open)
+{
+    const __m256d magic = _mm256_set1_pd(4503599627370496.0);        // 2^52, integers below it sit in the mantissa
+    const __m256d half = _mm256_set1_pd(4503599627370496.0 - 0.5);
+    const __m256d inverse = _mm256_set1_pd(1.0 / 25);
+    __m256i mag = _mm256_abs_epi32(flow);
+    __m256i q[2];
+    for (int k = 0; k < 2; k++)
+    {
+        __m256i v = _mm256_srli_epi64(_mm256_mul_epu32(mag, open), 22);
+        __m256d x = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(v, _mm256_castpd_si256(magic))), half);
+        __m256d y = _mm256_round_pd(_mm256_mul_pd(x, inverse), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        q[k] = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(y, magic)), _mm256_castpd_si256(magic));
+        mag = _mm256_srli_epi64(mag, 32);
+        open = _mm256_srli_epi64(open, 32);
+    }
+    __m256i mov = _mm256_blend_epi32(q[0], _mm256_slli_epi64(q[1], 32), 0xAA);
+    return _mm256_sign_epi32(mov, flow);
+}
+
+__attribute__((target("avx2")))
+void FastSim::sim_valves_avx2(const Pressure* value, Pressure* move_next)
+{
+    alignas(32) Pressure delta[8];
+    const uint32_t* lanes = extras->valve_lanes.data();
+    uint32_t blocks = valves.size() / 8;
+    for (uint32_t j = 0; j < blocks; j++, lanes += 32)
+    {
+        __m256i n = avx2_gather(value, lanes);
+        __m256i e = avx2_gather(value, lanes + 8);
+        __m256i s = avx2_gather(value, lanes + 16);
+        __m256i w = avx2_gather(value, lanes + 24);
+        __m256i open = _mm256_max_epi32(_mm256_sub_epi32(n, s), _mm256_setzero_si256());
+        _mm256_store_si256((__m256i*)delta, avx2_valve_div(_mm256_sub_epi32(w, e), open));
+        for (int k = 0; k < 8; k++)
+        {
+            move_next[lanes[k + 24]] -= delta[k];
+            move_next[lanes[k + 8]] += delta[k];
+        }
+    }
+    for (uint32_t i = blocks * 8; i < valves.size(); i++)
+        valves[i].sim(value, move_next);
+}
+
+#endif
+
+// Shared nodes are left alone, every instance would write to the same pressure
+
+void FastSim::store()
+{
+    for (uint32_t i = 0; i < vented_end; i++)
+        if (!node_shared[i])
+            node_pressure[i]->value = value[i];
+}
+
+bool FastSim::load_state(const std::vector<Pressure>& state)
+{
+    if (state.size() != vented_end)
+        return false;
+    std::copy(state.begin(), state.end(), value.begin());
+    wake_all();
+    store();
+    return true;
+}
+
+void FastSim::reset()
+{
+    for (uint32_t i = 0; i < vented_end; i++)
+        value[i] = 0;
+    ticked = false;
+    wake_all();
+}
+
+// Elements other than subcircuits are tiny, and are made and dropped in their thousands whenever
+// a level set is loaded or a circuit copied. They come from fixed size blocks carved out of
+// larger slabs. Each thread keeps a small free list of its own, so most allocations take no lock,
+// and spills whole batches to a shared list once it holds more than two slabs' worth. Blocks
+// freed on a thread that never allocates (the server deletes level sets on its network thread
+// after elaborating them on a worker) therefore find their way back to the threads that need them.
+// Slabs are never returned, so the pool stays at its high water mark, but that mark is shared by
+// every thread rather than growing with each one.
+
+class ElementPool
+{
+public:
+    static const size_t BLOCK_SIZE = 32;
+    static const size_t SLAB_BLOCKS = 512;
+    class Block
+    {
+    public:
+        Block* next;
+    };
+
+    class Cache                     // trivially destructible, so it outlives the thread's other thread_locals
+    {
+    public:
+        Block* free;
+        size_t count;
+        bool exited;
+    };
+
+    class CacheFlush                // hands the cache to the shared list when the thread exits
+    {
+    public:
+        ~CacheFlush();
+    };
+
+    static std::mutex shared_mutex;
+    static Block* shared_free;
+    static thread_local Cache cache;
+    static thread_local CacheFlush cache_flush;
+
+    static void give_shared(Block* first, Block* last)
+    {
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        last->next = shared_free;
+        shared_free = first;
+    }
+
+    static void* allocate()
+    {
+        if (!cache.free)
+        {
+            (void)&cache_flush;     // registers the flush on the first allocation
+            {
+                std::lock_guard<std::mutex> lock(shared_mutex);
+                Block* block = shared_free;
+                for (size_t i = 0; block && i < SLAB_BLOCKS; i++)
+                {
+                    shared_free = block->next;
+                    block->next = cache.free;
+                    cache.free = block;
+                    cache.count++;
+                    block = shared_free;
+                }
+            }
+            if (!cache.free)
+            {
+                char* slab = (char*)::operator new(BLOCK_SIZE * SLAB_BLOCKS);
+                for (size_t i = 0; i < SLAB_BLOCKS; i++)
+                {
+                    Block* block = (Block*)(slab + i * BLOCK_SIZE);
+                    block->next = cache.free;
+                    cache.free = block;
+                }
+                cache.count += SLAB_BLOCKS;
+            }
+        }
+        Block* block = cache.free;
+        cache.free = block->next;
+        cache.count--;
+        return block;
+    }
+
+    static void release(void* ptr)
+    {
+        Block* block = (Block*)ptr;
+        if (cache.exited)           // thread_local destructors have run, deletes from static destructors
+        {
+            give_shared(block, block);
+            return;
+        }
+        if (!cache.free)
+            (void)&cache_flush;     // threads that only free hand their blocks back on exit too
+        block->next = cache.free;
+        cache.free = block;
+        cache.count++;
+        if (cache.count > SLAB_BLOCKS * 2)
+        {
+            Block* first = cache.free;
+            Block* last = first;
+            for (size_t i = 1; i < SLAB_BLOCKS; i++)
+                last = last->next;
+            cache.free = last->next;
+            cache.count -= SLAB_BLOCKS;
+            give_shared(first, last);
+        }
+    }
+};
+
+ElementPool::CacheFlush::~CacheFlush()
+{
+    Cache& c = cache;
+    c.exited = true;
+    if (!c.free)
+        return;
+    Block* last = c.free;
+    while (last->next)
+        last = last->next;
+    give_shared(c.free, last);
+    c.free = NULL;
+    c.count = 0;
+}
+
+std::mutex ElementPool::shared_mutex;
+ElementPool::Block* ElementPool::shared_free = NULL;
+thread_local ElementPool::Cache ElementPool::cache = {NULL, 0, false};
+thread_local ElementPool::CacheFlush ElementPool::cache_flush;
+
+void* CircuitElement::operator new(size_t size)
+{
+    if (size <= ElementPool::BLOCK_SIZE)
+        return ElementPool::allocate();
+    return ::operator new(size);
+}
+
+void CircuitElement::operator delete(void* ptr, size_t size)
+{
+    if (size <= ElementPool::BLOCK_SIZE)
+        ElementPool::release(ptr);
+    else
+        ::operator delete(ptr);
 }
 
 SaveObject* CircuitElement::save()
@@ -505,17 +1635,6 @@ void CircuitElementValve::sim_prep(PressureAdjacent adj_, FastSim& fast_sim)
      PressureAdjacent adj(adj_, dir_flip);
      fast_sim.add_valve(*this, adj);
 }
-void CircuitElementValve::sim(PressureAdjacent adj)
-{
-    int64_t mul = (adj.N.value - adj.S.value);
-    if (mul < 0)
-        mul = 0;
-
-                                                            // base resistence is 8 pipes
-    Pressure mov = (int64_t(adj.W.value - adj.E.value) * mul) / (int64_t(100) * 2 * resistence * PRESSURE_SCALAR);
-    adj.W.move(-mov);
-    adj.E.move(mov);
-}
 
 CircuitElementSource::CircuitElementSource(SaveObjectMap* omap)
 {
@@ -573,7 +1692,8 @@ XYPos CircuitElementEmpty::getimage(void)
 
 CircuitElementSubCircuit::~CircuitElementSubCircuit()
 {
-    delete circuit;
+    if (!shared)
+        delete circuit;
     delete texture;
 
 }
@@ -642,16 +1762,16 @@ CircuitElementSubCircuit::CircuitElementSubCircuit(SaveObjectMap* omap, unsigned
     }
 }
 
-CircuitElementSubCircuit::CircuitElementSubCircuit(CircuitElementSubCircuit& other)
+CircuitElementSubCircuit::CircuitElementSubCircuit(CircuitElementSubCircuit& other, bool elaborated)
 {
     dir_flip = other.dir_flip;
     level_index = other.level_index;
     level = other.level;
     custom  = other.custom;
     name = other.name;
-    if (other.circuit)
+    if (other.circuit && (elaborated || custom))    // copies may be simulated on other threads, so they never share
     {
-        circuit = new Circuit(*other.circuit);
+        circuit = new Circuit(*other.circuit, elaborated);
     }
     for (unsigned y = 0; y < 24; y++)
         for (unsigned x = 0; x < 24*8; x++)
@@ -727,10 +1847,19 @@ CircuitElement* CircuitElementSubCircuit::copy()
     return new CircuitElementSubCircuit(*this);
 }
 
+CircuitElement* CircuitElementSubCircuit::copy_unelaborated()
+{
+    return new CircuitElementSubCircuit(*this, false);
+}
+
+
+// A shared template holds no state of its own, see FastSim::node_shared, and resetting it from
+// every instance would race between the threads scoring its level set.
 
 void CircuitElementSubCircuit::reset()
 {
-    circuit->reset();
+    if (!shared)
+        circuit->reset();
 };
 
 void CircuitElementSubCircuit::elaborate(LevelSet* level_set, std::set<unsigned> seen)
@@ -753,18 +1882,25 @@ void CircuitElementSubCircuit::elaborate(LevelSet* level_set, std::set<unsigned>
 
     if (level_index >= LEVEL_COUNT)
         name = level->name;
+    std::set<unsigned> sub_seen(seen);
     if (!custom)
     {
         assert (level_index >= 0);
-        delete circuit;
+        if (!shared)
+            delete circuit;
+        sub_seen.insert(level_index);
+        if (level_set->share_subcircuits)
+        {
+            circuit = level_set->get_subcircuit_template(level_index, sub_seen);
+            shared = true;
+            return;
+        }
 //        level->circuit->remove_circles(level_set);
         circuit = new Circuit(*level->circuit);
+        shared = false;
     }
     assert(circuit);
     
-    std::set<unsigned> sub_seen(seen);
-    if (!custom)
-        sub_seen.insert(level_index);
     circuit->elaborate(level_set, sub_seen);
 };
 
@@ -773,8 +1909,10 @@ void CircuitElementSubCircuit::retire()
     if (!custom && circuit)
     {
         delete texture;
-        delete circuit;
+        if (!shared)
+            delete circuit;
         circuit = NULL;
+        shared = false;
     }
 }
 
@@ -849,14 +1987,25 @@ PixelData* CircuitElementSubCircuit::get_pixel_data()
 
 void CircuitElementSubCircuit::sim_prep(PressureAdjacent adj_, FastSim& fast_sim)
 {
-    static CircuitPressure def;
-    PressureAdjacent adj(PressureAdjacent(adj_, getconnections(), def), dir_flip);
+    PressureAdjacent adj(PressureAdjacent(adj_, getconnections(), fast_sim.null_pressure), dir_flip);
 
     assert(circuit);
+    if (shared)
+    {
+        fast_sim.enter_instance(adj);
+        circuit->sim_prep(adj, fast_sim);
+        fast_sim.leave_instance();
+        return;
+    }
     circuit->sim_prep(adj, fast_sim);
 }
 void CircuitElementSubCircuit::set_custom(bool recurse)
 {
+    if (shared)
+    {
+        circuit = new Circuit(*circuit);
+        shared = false;
+    }
     custom = true;
     if (level_index >= LEVEL_COUNT)
     {
@@ -894,9 +2043,10 @@ void CircuitElementSubCircuit::reindex_deleted_level(LevelSet* level_set, int de
         if (!custom)
         {
             elaborate(level_set);
-            if (circuit)
+            if (!shared)
                 delete circuit;
             circuit = new Circuit(*level->circuit);
+            shared = false;
             set_custom();
         }
     }
@@ -992,6 +2142,9 @@ void Sign::flip(bool vertically)
 }
 
 
+std::atomic<uint64_t> Circuit::edit_stamps = 0;
+bool Circuit::cache_prep = true;
+
 Circuit::Circuit(SaveObjectMap* omap, unsigned version)
 {
     SaveObjectList* slist_y = omap->get_item("elements")->get_list();
@@ -1029,14 +2182,15 @@ Circuit::Circuit()
     }
 }
 
-Circuit::Circuit(Circuit& other) :
+Circuit::Circuit(Circuit& other, bool elaborated) :
     signs(other.signs)
 {
     XYPos pos;
     for (pos.y = 0; pos.y < 9; pos.y++)
     for (pos.x = 0; pos.x < 9; pos.x++)
     {
-        elements[pos.y][pos.x] = other.elements[pos.y][pos.x]->copy();
+        CircuitElement* element = other.elements[pos.y][pos.x];
+        elements[pos.y][pos.x] = elaborated ? element->copy() : element->copy_unelaborated();
     }
     signs = other.signs;
 }
@@ -1049,10 +2203,10 @@ Circuit::~Circuit()
     {
         delete elements[pos.y][pos.x];
     }
-    for (const Circuit* c: undo_list)
-        delete c;
-    for (const Circuit* c: redo_list)
-        delete c;
+    history_clear(undo_list);
+    history_clear(redo_list);
+    delete history_base;
+    delete prep_cache;
 }
 
 SaveObject* Circuit::save()
@@ -1104,6 +2258,7 @@ SaveObject* Circuit::save()
 
 void Circuit::copy_elements(Circuit& other)
 {
+    edit_stamp = ++edit_stamps;
     signs = other.signs;
     XYPos pos;
     for (pos.y = 0; pos.y < 9; pos.y++)
@@ -1136,6 +2291,7 @@ void Circuit::reset()
     {
         elements[pos.y][pos.x]->reset();
     }
+    fast_sim.reset();
     fast_prepped = false;
 }
 
@@ -1143,6 +2299,7 @@ void Circuit::elaborate(LevelSet* level_set, std::set<unsigned> seen)
 {
     XYPos pos;
     fast_prepped = false;
+    edit_stamp = ++edit_stamps;
     for (pos.y = 0; pos.y < 9; pos.y++)
     for (pos.x = 0; pos.x < 9; pos.x++)
     {
@@ -1191,7 +2348,7 @@ void Circuit::render_prep()
 
 }
 
-void Circuit::sim_prep(PressureAdjacent adj, FastSim& fast_sim)
+void Circuit::sim_prep_touched()
 {
     XYPos pos;
     for (pos.y = 0; pos.y < 10; pos.y++)
@@ -1218,19 +2375,17 @@ void Circuit::sim_prep(PressureAdjacent adj, FastSim& fast_sim)
             touched_ns[pos.y+1][pos.x] |= 1;
         if ((con >> DIRECTION_W) & 1)
             touched_ew[pos.y][pos.x] |= 2;
-
-        PressureAdjacent adjl(connections_ns[pos.y][pos.x],
-                                 connections_ew[pos.y][pos.x+1],
-                                 connections_ns[pos.y+1][pos.x],
-                                 connections_ew[pos.y][pos.x]);
-        elements[pos.y][pos.x]->sim_prep(adjl, fast_sim);
     }
+}
 
+void Circuit::sim_prep_connections(PressureAdjacent adj, FastSim& fast_sim)
+{
     fast_sim.add_pipe2(connections_ns[0][4], adj.N);
     fast_sim.add_pipe2(connections_ew[4][9], adj.E);
     fast_sim.add_pipe2(connections_ns[9][4], adj.S);
     fast_sim.add_pipe2(connections_ew[4][0], adj.W);
 
+    XYPos pos;
     for (pos.y = 0; pos.y < 10; pos.y++)
     for (pos.x = 0; pos.x < 10; pos.x++)
     {
@@ -1260,16 +2415,132 @@ void Circuit::sim_prep(PressureAdjacent adj, FastSim& fast_sim)
             fast_sim.add_pressure_vented(connections_ew[pos.y][pos.x]);
         }
     }
+}
 
+void Circuit::sim_prep(PressureAdjacent adj, FastSim& fast_sim)
+{
+    sim_prep_touched();
+
+    XYPos pos;
+    for (pos.y = 0; pos.y < 9; pos.y++)
+    for (pos.x = 0; pos.x < 9; pos.x++)
+    {
+        PressureAdjacent adjl(connections_ns[pos.y][pos.x],
+                                 connections_ew[pos.y][pos.x+1],
+                                 connections_ns[pos.y+1][pos.x],
+                                 connections_ew[pos.y][pos.x]);
+        int level_index = -1;
+        if (fast_sim.profiling() && elements[pos.y][pos.x]->get_subcircuit(&level_index))
+        {
+            fast_sim.profile_enter(pos, level_index, elements[pos.y][pos.x]->get_custom(), adjl);
+            elements[pos.y][pos.x]->sim_prep(adjl, fast_sim);
+            fast_sim.profile_leave();
+            continue;
+        }
+        elements[pos.y][pos.x]->sim_prep(adjl, fast_sim);
+    }
+
+    sim_prep_connections(adj, fast_sim);
     fast_prepped = true;
 }
 
+// Same as sim_prep into our own fast_sim, but a cell which has not changed since the last prep
+// links in the fragment it added then rather than being walked again. Subcircuits are where the
+// walking goes, and a moved subcircuit keeps its fragment as it does not depend on position.
+// This only caches the walk: compile() still runs over the whole graph afterwards.
+
+void Circuit::sim_prep_cached(PressureAdjacent adj)
+{
+    if (!prep_cache)
+    {
+        prep_cache = new CircuitPrepCache;
+        prep_cache->cells.resize(9 * 9);
+    }
+    std::vector<CircuitPrepCache::Cell>& cells = prep_cache->cells;
+    std::vector<CircuitPrepCache::Cell>& old_cells = prep_cache->old_cells;
+    std::swap(cells, old_cells);
+    cells.resize(9 * 9);
+
+    sim_prep_touched();
+
+    XYPos pos;
+    for (pos.y = 0; pos.y < 9; pos.y++)
+    for (pos.x = 0; pos.x < 9; pos.x++)
+    {
+        CircuitElement* element = elements[pos.y][pos.x];
+        CircuitPrepCache::Cell& cell = cells[pos.y * 9 + pos.x];
+        PressureAdjacent adjl(connections_ns[pos.y][pos.x],
+                                 connections_ew[pos.y][pos.x+1],
+                                 connections_ns[pos.y+1][pos.x],
+                                 connections_ew[pos.y][pos.x]);
+
+        CircuitPrepCache::Cell* old = &old_cells[pos.y * 9 + pos.x];
+        Circuit* subcircuit = element->get_subcircuit();
+        if (old->element != element && subcircuit)
+        {
+            for (CircuitPrepCache::Cell& other : old_cells)
+                if (other.element == element)
+                    old = &other;
+        }
+        if (old->element == element
+         && old->type == element->get_type()
+         && old->desc == element->get_desc()
+         && old->connections == element->getconnections()
+         && old->subcircuit == subcircuit
+         && (!subcircuit || old->edit_stamp == subcircuit->get_edit_stamp()))
+        {
+            std::swap(cell, *old);
+            old->element = NULL;
+        }
+        else
+        {
+            FastSim& scratch = prep_cache->scratch;
+            scratch.clear();
+            element->sim_prep(adjl, scratch);
+            scratch.record_fragment(cell.fragment, adjl);
+            cell.element = element;
+            cell.type = element->get_type();
+            cell.desc = element->get_desc();
+            cell.connections = element->getconnections();
+            cell.subcircuit = subcircuit;
+            cell.edit_stamp = subcircuit ? subcircuit->get_edit_stamp() : 0;
+        }
+        fast_sim.add_fragment(cell.fragment, adjl);
+    }
+
+    sim_prep_connections(adj, fast_sim);
+    fast_prepped = true;
+}
+
+// Edits to a custom subcircuit happen inside it, so its stamp counts too. Anything else is
+// replaced with a fresh circuit, and so a fresh stamp, when it changes.
+
+uint64_t Circuit::get_edit_stamp()
+{
+    uint64_t stamp = edit_stamp;
+    XYPos pos;
+    for (pos.y = 0; pos.y < 9; pos.y++)
+    for (pos.x = 0; pos.x < 9; pos.x++)
+    {
+        if (!elements[pos.y][pos.x]->get_custom())
+            continue;
+        Circuit* subcircuit = elements[pos.y][pos.x]->get_subcircuit();
+        if (subcircuit)
+            stamp = std::max(stamp, subcircuit->get_edit_stamp());
+    }
+    return stamp;
+}
+
 void Circuit::prep(PressureAdjacent adj)
 {
     if (!fast_prepped)
     {
     	fast_sim.clear();
-        sim_prep(adj, fast_sim);
+        if (fast_sim.profiling() || !cache_prep)   // fragments don't know which subcircuit their parts came from
+            sim_prep(adj, fast_sim);
+        else
+            sim_prep_cached(adj);
+        fast_sim.compile();
     }
 }
 
@@ -1334,7 +2605,10 @@ void Circuit::set_element_empty(XYPos pos, bool no_history)
     if (!no_history)
         ammend();
     else
+    {
         fast_prepped = false;
+        edit_stamp = ++edit_stamps;
+    }
     delete elements[pos.y][pos.x];
     elements[pos.y][pos.x] = new CircuitElementEmpty();
 }
@@ -1682,6 +2956,7 @@ void Circuit::add_pipe_drag_list(std::list<XYPos> &pipe_drag_list)
 
 void Circuit::force_element(XYPos pos, CircuitElement* element)
 {
+    edit_stamp = ++edit_stamps;
     delete elements[pos.y][pos.x];
     elements[pos.y][pos.x] = element;
     blocked[pos.y][pos.x] = true;
@@ -1705,24 +2980,210 @@ bool Circuit::is_blocked(XYPos pos)
     return blocked[pos.y][pos.x];
 }
 
+CircuitUndo::~CircuitUndo()
+{
+    for (Cell& cell : cells)
+        delete cell.element;
+}
+
+size_t Circuit::history_memory_limit = 64 * 1024 * 1024;
+
+static size_t circuit_memory(Circuit& circuit);
+
+// History elements are unelaborated copies, so the only subcircuits holding a circuit are custom
+// ones, and their own subcircuits are unelaborated in turn
+
+static size_t element_memory(CircuitElement* element)
+{
+    switch (element->get_type())
+    {
+        case CIRCUIT_ELEMENT_TYPE_PIPE:
+            return sizeof(CircuitElementPipe);
+        case CIRCUIT_ELEMENT_TYPE_VALVE:
+            return sizeof(CircuitElementValve);
+        case CIRCUIT_ELEMENT_TYPE_SOURCE:
+            return sizeof(CircuitElementSource);
+        case CIRCUIT_ELEMENT_TYPE_SUBCIRCUIT:
+        {
+            Circuit* subcircuit = element->get_subcircuit();
+            return sizeof(CircuitElementSubCircuit) + (subcircuit ? circuit_memory(*subcircuit) : 0);
+        }
+        default:
+            return sizeof(CircuitElementEmpty);
+    }
+}
+
+static size_t circuit_memory(Circuit& circuit)
+{
+    size_t memory = sizeof(Circuit);
+    XYPos pos;
+    for (pos.y = 0; pos.y < 9; pos.y++)
+    for (pos.x = 0; pos.x < 9; pos.x++)
+        memory += element_memory(circuit.elements[pos.y][pos.x]);
+    return memory;
+}
+
+static bool same_signs(std::list<Sign>& a, std::list<Sign>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (auto ia = a.begin(), ib = b.begin(); ia != a.end(); ia++, ib++)
+    {
+        if (ia->pos != ib->pos || ia->direction != ib->direction || ia->text != ib->text)
+            return false;
+    }
+    return true;
+}
+
+// Non-custom elements which describe the same are interchangeable, as in copy_elements. A custom
+// subcircuit has to match all the way down.
+
+static bool same_element(CircuitElement* a, CircuitElement* b)
+{
+    if (a->get_type() != b->get_type() || a->get_desc() != b->get_desc())
+        return false;
+    if (!a->get_custom())
+        return true;
+    Circuit* ca = a->get_subcircuit();
+    Circuit* cb = b->get_subcircuit();
+    return ca && cb && ca->same_as(*cb);
+}
+
+bool Circuit::same_as(Circuit& other)
+{
+    XYPos pos;
+    for (pos.y = 0; pos.y < 9; pos.y++)
+    for (pos.x = 0; pos.x < 9; pos.x++)
+    {
+        if (!same_element(elements[pos.y][pos.x], other.elements[pos.y][pos.x]))
+            return false;
+    }
+    return same_signs(signs, other.signs);
+}
+
+// Catches the checkpoint up with the circuit. When recording, the cells which changed since are
+// an undo step, holding the elements the checkpoint had there. Otherwise the changes were not
+// edits (remove_circles, loading) and are just taken in.
+
+void Circuit::history_sync(bool record)
+{
+    if (!history_base)
+    {
+        history_base = new CircuitUndo;
+        XYPos pos;
+        for (pos.y = 0; pos.y < 9; pos.y++)
+        for (pos.x = 0; pos.x < 9; pos.x++)
+            history_base->cells.push_back(CircuitUndo::Cell(pos, elements[pos.y][pos.x]->copy_unelaborated()));
+        history_base->has_signs = true;
+        history_base->signs = signs;
+        return;
+    }
+
+    CircuitUndo* step = record ? new CircuitUndo : NULL;
+    for (CircuitUndo::Cell& cell : history_base->cells)
+    {
+        CircuitElement* element = elements[cell.pos.y][cell.pos.x];
+        if (same_element(cell.element, element))
+            continue;
+        if (step)
+        {
+            step->cells.push_back(cell);
+            step->memory += element_memory(cell.element);
+        }
+        else
+            delete cell.element;
+        cell.element = element->copy_unelaborated();
+    }
+    if (!same_signs(history_base->signs, signs))
+    {
+        if (step)
+        {
+            step->has_signs = true;
+            step->signs.swap(history_base->signs);
+        }
+        history_base->signs = signs;
+    }
+    if (!step)
+        return;
+    if (step->cells.empty() && !step->has_signs)
+    {
+        delete step;
+        return;
+    }
+
+    undo_list.push_front(step);
+    history_memory += step->memory;
+    while (history_memory > history_memory_limit && undo_list.size() > 1)
+    {
+        history_memory -= undo_list.back()->memory;
+        delete undo_list.back();
+        undo_list.pop_back();
+    }
+}
+
+// Puts a step back, and returns the step that would put it back again. Cells which are not in the
+// step are left alone, so unchanged subcircuits keep their elaborated circuits.
+
+CircuitUndo* Circuit::history_apply(CircuitUndo* step)
+{
+    CircuitUndo* inverse = new CircuitUndo;
+    for (CircuitUndo::Cell& cell : step->cells)
+    {
+        XYPos pos = cell.pos;
+        CircuitUndo::Cell& base = history_base->cells[pos.y * 9 + pos.x];
+        inverse->cells.push_back(base);
+        inverse->memory += element_memory(base.element);
+        base.element = cell.element->copy_unelaborated();
+        delete elements[pos.y][pos.x];
+        elements[pos.y][pos.x] = cell.element;
+    }
+    step->cells.clear();
+    if (step->has_signs)
+    {
+        inverse->has_signs = true;
+        inverse->signs.swap(signs);
+        signs = step->signs;
+        history_base->signs = step->signs;
+    }
+    history_memory += inverse->memory;
+    history_memory -= step->memory;
+    delete step;
+    fast_prepped = false;
+    edit_stamp = ++edit_stamps;
+    return inverse;
+}
+
+void Circuit::history_clear(std::list<CircuitUndo*>& list)
+{
+    for (CircuitUndo* step : list)
+    {
+        history_memory -= step->memory;
+        delete step;
+    }
+    list.clear();
+}
+
+// Called before an edit. The edit itself is only recorded once it is over, at the next ammend,
+// undo or redo, by comparing against the checkpoint taken here.
+
 void Circuit::ammend()
 {
     fast_prepped = false;
-    undo_list.push_front(new Circuit(*this));
-    for (const Circuit* c: redo_list)
-        delete c;
-    redo_list.clear();
+    edit_stamp = ++edit_stamps;
+    history_sync(history_open);
+    history_open = true;
+    history_clear(redo_list);
 }
 
 void Circuit::undo(LevelSet* level_set)
 {
+    history_sync(history_open);
+    history_open = false;
     if (!undo_list.empty())
     {
-        redo_list.push_front(new Circuit(*this));
-        Circuit* to = undo_list.front();
+        CircuitUndo* step = undo_list.front();
         undo_list.pop_front();
-        copy_elements(*to);
-        delete to;
+        redo_list.push_front(history_apply(step));
         remove_circles(level_set);
         elaborate(level_set);
     }
@@ -1730,13 +3191,13 @@ void Circuit::undo(LevelSet* level_set)
 
 void Circuit::redo(LevelSet* level_set)
 {
+    history_sync(history_open);
+    history_open = false;
     if (!redo_list.empty())
     {
-        undo_list.push_front(new Circuit(*this));
-        Circuit* to = redo_list.front();
+        CircuitUndo* step = redo_list.front();
         redo_list.pop_front();
-        copy_elements(*to);
-        delete to;
+        undo_list.push_front(history_apply(step));
         remove_circles(level_set);
         elaborate(level_set);
     }
@@ -1819,6 +3280,7 @@ SaveObjectList* Circuit::save_forced()
 
 void Circuit::copy_in(Circuit* other)
 {
+    edit_stamp = ++edit_stamps;
     XYPos pos;
     for (pos.y = 0; pos.y < 9; pos.y++)
     for (pos.x = 0; pos.x < 9; pos.x++)
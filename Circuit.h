@@ -6,10 +6,17 @@
 #include <set>
 #include <list>
 #include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
 #include <SDL.h>
 
 #define PRESSURE_SCALAR (65536)
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define FAST_SIM_AVX2
+#endif
+
 class LevelSet;
 class Level;
 
@@ -164,111 +171,302 @@ class FastSim
 {
     class FastSimPipe2
     {
-        CircuitPressure& a;
-        CircuitPressure& b;
     public:
-        FastSimPipe2(CircuitPressure& a_, CircuitPressure& b_):
+        uint32_t a;
+        uint32_t b;
+        FastSimPipe2(uint32_t a_, uint32_t b_):
             a(a_),
             b(b_)
         {}
-        void sim()
+        bool sim(const Pressure* value, Pressure* move_next)
         {
-            Pressure mov = (a.value - b.value) / 2;
-            a.move(-mov);
-            b.move(mov);
+            Pressure mov = (value[a] - value[b]) / 2;
+            move_next[a] -= mov;
+            move_next[b] += mov;
+            return mov;
         }
     };
 
     class FastSimPipe3
     {
-        CircuitPressure& a;
-        CircuitPressure& b;
-        CircuitPressure& c;
     public:
-        FastSimPipe3(CircuitPressure& a_, CircuitPressure& b_, CircuitPressure& c_):
+        uint32_t a;
+        uint32_t b;
+        uint32_t c;
+        FastSimPipe3(uint32_t a_, uint32_t b_, uint32_t c_):
             a(a_),
             b(b_),
             c(c_)
         {}
-        void sim()
+        bool sim(const Pressure* value, Pressure* move_next)
         {
-            Pressure mov = (a.value - b.value) / 3;
-            a.move(-mov);
-            b.move(mov);
-
-            mov = (a.value - c.value) / 3;
-            a.move(-mov);
-            c.move(mov);
-
-            mov = (b.value - c.value) / 3;
-            b.move(-mov);
-            c.move(mov);
+            Pressure mov = (value[a] - value[b]) / 3;
+            move_next[a] -= mov;
+            move_next[b] += mov;
+            Pressure moved = mov;
+
+            mov = (value[a] - value[c]) / 3;
+            move_next[a] -= mov;
+            move_next[c] += mov;
+            moved |= mov;
+
+            mov = (value[b] - value[c]) / 3;
+            move_next[b] -= mov;
+            move_next[c] += mov;
+            moved |= mov;
+            return moved;
         }
     };
 
     class FastSimPipe4
     {
-        CircuitPressure& a;
-        CircuitPressure& b;
-        CircuitPressure& c;
-        CircuitPressure& d;
     public:
-        FastSimPipe4(CircuitPressure& a_, CircuitPressure& b_, CircuitPressure& c_, CircuitPressure& d_):
+        uint32_t a;
+        uint32_t b;
+        uint32_t c;
+        uint32_t d;
+        FastSimPipe4(uint32_t a_, uint32_t b_, uint32_t c_, uint32_t d_):
             a(a_),
             b(b_),
             c(c_),
             d(d_)
         {}
-        void sim()
+        bool sim(const Pressure* value, Pressure* move_next)
         {
-            Pressure mov = (a.value - b.value) / 4;
-            a.move(-mov);
-            b.move(mov);
-
-            mov = (a.value - c.value) / 4;
-            a.move(-mov);
-            c.move(mov);
-
-            mov = (b.value - c.value) / 4;
-            b.move(-mov);
-            c.move(mov);
-
-            mov = (a.value - d.value) / 4;
-            a.move(-mov);
-            d.move(mov);
-
-            mov = (b.value - d.value) / 4;
-            b.move(-mov);
-            d.move(mov);
-
-            mov = (c.value - d.value) / 4;
-            c.move(-mov);
-            d.move(mov);
+            Pressure mov = (value[a] - value[b]) / 4;
+            move_next[a] -= mov;
+            move_next[b] += mov;
+            Pressure moved = mov;
+
+            mov = (value[a] - value[c]) / 4;
+            move_next[a] -= mov;
+            move_next[c] += mov;
+            moved |= mov;
+
+            mov = (value[b] - value[c]) / 4;
+            move_next[b] -= mov;
+            move_next[c] += mov;
+            moved |= mov;
+
+            mov = (value[a] - value[d]) / 4;
+            move_next[a] -= mov;
+            move_next[d] += mov;
+            moved |= mov;
+
+            mov = (value[b] - value[d]) / 4;
+            move_next[b] -= mov;
+            move_next[d] += mov;
+            moved |= mov;
+
+            mov = (value[c] - value[d]) / 4;
+            move_next[c] -= mov;
+            move_next[d] += mov;
+            moved |= mov;
+            return moved;
         }
     };
 
     class FastSimValve
     {
-        PressureAdjacent adj;
-        CircuitElementValve& valve;
     public:
-        FastSimValve(CircuitElementValve& valve_, PressureAdjacent adj_):
-            valve(valve_),
-            adj(adj_)
+        uint32_t n;
+        uint32_t e;
+        uint32_t s;
+        uint32_t w;
+        FastSimValve(uint32_t n_, uint32_t e_, uint32_t s_, uint32_t w_):
+            n(n_),
+            e(e_),
+            s(s_),
+            w(w_)
         {}
-        void sim();
+        inline bool sim(const Pressure* value, Pressure* move_next);
     };
-    
+
+    enum NodeType
+    {
+        NODE_TYPE_INTERNAL,
+        NODE_TYPE_VENTED,
+        NODE_TYPE_EXTERNAL,             // owned by the caller (level ports), gathered and scattered each tick
+        NODE_TYPE_NULL,                 // unconnected subcircuit pins, always reads zero
+        NODE_TYPE_COUNT
+    };
+
     std::vector<FastSimPipe2> pipe2;
     std::vector<FastSimPipe3> pipe3;
     std::vector<FastSimPipe4> pipe4;
     std::vector<FastSimValve> valves;
-    std::vector<CircuitPressure*> sources;
-    std::vector<CircuitPressure*> fast_pressures;
-    std::vector<CircuitPressure*> fast_pressures_vent;
+    std::vector<uint32_t> sources;
+
+    class NodeKey                       // a shared subcircuit appears once per instance, so a pressure alone is not unique
+    {
+    public:
+        CircuitPressure* pres;
+        uint32_t instance;
+        bool operator==(const NodeKey& other) const {return pres == other.pres && instance == other.instance;}
+    };
+    class NodeKeyHash
+    {
+    public:
+        size_t operator()(const NodeKey& key) const {return std::hash<CircuitPressure*>()(key.pres) ^ (size_t(key.instance) * 0x9E3779B97F4A7C15ull);}
+    };
+    class Instance
+    {
+    public:
+        uint32_t id;
+        CircuitPressure* pins[4];       // pressures of the enclosing circuit, they keep the nodes they had there
+        uint32_t pin_nodes[4];
+    };
+
+    std::vector<Pressure> value;
+    std::vector<Pressure> move_next;
+    std::vector<CircuitPressure*> node_pressure;
+    std::vector<NodeType> node_type;
+    std::vector<bool> node_shared;      // made inside a shared subcircuit, its pressure stands for every instance
+    std::unordered_map<NodeKey, uint32_t, NodeKeyHash> node_map;
+    std::vector<Instance> instances;
+    uint32_t instance_count = 0;
+    std::vector<uint32_t> fragment_local;   // node of each fragment node while linking it in
+
+    uint32_t internal_count = 0;        // nodes are ordered [internal | vented | external | null] once compiled
+    uint32_t vented_end = 0;
+    uint32_t external_end = 0;
+
+    static constexpr uint32_t NO_COMPONENT = UINT32_MAX;
+    std::vector<uint32_t> node_component;
+    std::vector<uint32_t> component_nodes;
+    std::vector<bool> component_frozen;
+
+    bool tracking = false;              // activity tracking was enabled when compiled
+    bool vectorized = false;            // the AVX2 kernel was picked when compiled, so the lanes are there
+    bool ticked = false;                // since the last reset, shared nodes have no state to carry over a re-prep
     int64_t steam_used;
+    uint64_t signature = 0;             // hash of the compiled layout, states only carry over between equal ones
+    uint64_t ticks = 0;
+
+    enum ProfileKind
+    {
+        PROFILE_PIPE2,
+        PROFILE_PIPE3,
+        PROFILE_PIPE4,
+        PROFILE_VALVE,
+        PROFILE_SOURCE
+    };
+    class ProfileScope                  // a subcircuit cell the walk went into, scope 0 is the circuit itself
+    {
+    public:
+        uint32_t parent = 0;
+        XYPos pos;
+        int level_index = -1;
+        bool custom = false;
+        uint32_t node_start = 0;
+        CircuitPressure* pins[4] = {};  // sides of the cell, they belong to the parent even if made in here
+        uint64_t nodes = 0;
+        uint64_t flows = 0;
+    };
+    class ProfileElement
+    {
+    public:
+        uint32_t scope;
+        uint8_t kind;
+    };
+
+    // State only some sims need, kept out of line so that every circuit does not carry it
+
+    class Extras
+    {
+    public:
+        std::vector<uint32_t> pipe2_lanes;  // node indices of each block of 8 pipes, one row of 8 per pipe end
+        std::vector<uint32_t> pipe3_lanes;
+        std::vector<uint32_t> pipe4_lanes;
+        std::vector<uint32_t> valve_lanes;  // rows of n, e, s and w
+
+        std::vector<uint32_t> node_element_start;
+        std::vector<uint32_t> node_elements;
+        std::vector<uint32_t> element_stamp;
+        std::vector<uint32_t> active;
+        std::vector<uint32_t> next_active;
+        uint32_t stamp = 0;
+        uint32_t untracked_ticks = 0;   // the active set was too large to be worth tracking, tick everything for a while
+        uint64_t element_count = 0;
+        uint64_t element_skipped = 0;
+
+        std::vector<ProfileScope> profile_scopes;   // only filled while profiling
+        std::vector<uint32_t> profile_node_scope;
+        std::vector<ProfileElement> profile_elements;
+        uint32_t profile_scope = 0;
+
+        void clear();
+    };
+    Extras* extras = NULL;              // made on first use, by the AVX2 kernel, activity tracking or profiling
+
+    Extras& get_extras()
+    {
+        if (!extras)
+            extras = new Extras;
+        return *extras;
+    }
+
+    uint32_t node(CircuitPressure& pres);
+    void find_components(std::vector<uint32_t>& component);
+    void compute_signature();
+    void compile_activity();
+    void profile_add(uint8_t kind) {if (profiling()) extras->profile_elements.push_back({extras->profile_scope, kind});}
+    void profile_compile(const std::vector<uint32_t>& component);
+    void flush_profile();
+    void wake_all();
+    void flush_activity();
+    void sim_tracked();
+#ifdef FAST_SIM_AVX2
+    void sim_pipes_avx2(const Pressure* value, Pressure* move_next);
+    void sim_valves_avx2(const Pressure* value, Pressure* move_next);
+#endif
 
 public:
+    class Fragment                      // the raw elements one cell added, linked in again without walking it
+    {
+    public:
+        enum
+        {
+            PIN_N,                      // nodes 0-3 are the sides of the cell, wherever it gets linked
+            PIN_E,
+            PIN_S,
+            PIN_W,
+            PIN_NULL,
+            PIN_COUNT,                  // everything after is PIN_COUNT + NodeType of a node the cell owns
+            SHARED = 0x80               // flag on a node the cell owns, see node_shared
+        };
+        std::vector<CircuitPressure*> nodes;    // in the order the walk created them
+        std::vector<uint8_t> node_kind;
+        std::vector<uint32_t> pipe2;    // indices into nodes, two, three or four per element
+        std::vector<uint32_t> pipe3;
+        std::vector<uint32_t> pipe4;
+        std::vector<uint32_t> valves;
+        std::vector<uint32_t> sources;
+    };
+
+    enum Kernel
+    {
+        KERNEL_SCALAR,
+        KERNEL_AVX2
+    };
+    static Kernel kernel;               // picked from CPUID at startup, scalar and SIMD results are identical
+    static bool track_activity;         // only tick elements next to a node which changed, or which moved pressure last tick
+    static bool freeze_components;      // leave out components which can never hold any pressure
+    static std::atomic<uint64_t> total_element_count;
+    static std::atomic<uint64_t> total_element_skipped;
+    static bool profile;                // attribute nodes and flows to the subcircuits that added them, see profile_report
+
+    CircuitPressure null_pressure;
+
+    FastSim() {}
+    FastSim(const FastSim&) = delete;
+    FastSim& operator=(const FastSim&) = delete;
+    ~FastSim()
+    {
+        flush_activity();
+        flush_profile();
+        delete extras;
+    }
     void clear()
     {
         pipe2.clear();
@@ -276,72 +474,96 @@ public:
         pipe4.clear();
         valves.clear();
         sources.clear();
-        fast_pressures.clear();
-        fast_pressures_vent.clear();
+        value.clear();
+        move_next.clear();
+        node_pressure.clear();
+        node_type.clear();
+        node_shared.clear();
+        node_map.clear();
+        instances.clear();
+        instance_count = 0;
+        node_component.clear();
+        component_nodes.clear();
+        component_frozen.clear();
+        flush_activity();
+        flush_profile();
+        tracking = false;
+        vectorized = false;
+        if (extras)
+            extras->clear();
+        internal_count = 0;
+        vented_end = 0;
+        external_end = 0;
+        signature = 0;
+        if (profile)
+            get_extras().profile_scopes.resize(1);
    }
     void add_pipe2(CircuitPressure& a, CircuitPressure& b)
     {
-        pipe2.push_back(FastSimPipe2(a, b));
+        pipe2.push_back(FastSimPipe2(node(a), node(b)));
+        profile_add(PROFILE_PIPE2);
     }
     void add_pipe3(CircuitPressure& a, CircuitPressure& b, CircuitPressure& c)
     {
-        pipe3.push_back(FastSimPipe3(a, b, c));
+        pipe3.push_back(FastSimPipe3(node(a), node(b), node(c)));
+        profile_add(PROFILE_PIPE3);
     }
     void add_pipe4(CircuitPressure& a, CircuitPressure& b, CircuitPressure& c, CircuitPressure& d)
     {
-        pipe4.push_back(FastSimPipe4(a, b, c, d));
+        pipe4.push_back(FastSimPipe4(node(a), node(b), node(c), node(d)));
+        profile_add(PROFILE_PIPE4);
     }
     void add_valve(CircuitElementValve& valve, PressureAdjacent adj);
+    void enter_instance(PressureAdjacent adj);
+    void leave_instance() {instances.pop_back();}
     void add_source(CircuitPressure& a)
     {
-        sources.push_back(&a);
+        sources.push_back(node(a));
+        profile_add(PROFILE_SOURCE);
     }
     void add_pressure(CircuitPressure& pres)
     {
-        fast_pressures.push_back(&pres);
+        node_type[node(pres)] = NODE_TYPE_INTERNAL;
     }
     void add_pressure_vented(CircuitPressure& pres)
     {
-        fast_pressures_vent.push_back(&pres);
+        node_type[node(pres)] = NODE_TYPE_VENTED;
     }
-    
-    void sim()
-    {
-        for (CircuitPressure* con : fast_pressures)
-            con->pre();
-        for (CircuitPressure* con : fast_pressures_vent)
-        {
-            con->pre();
-            con->vent();
-        }
+    bool profiling() {return extras && !extras->profile_scopes.empty();}
+    void profile_enter(XYPos pos, int level_index, bool custom, PressureAdjacent adj);
+    void profile_leave();
+    static std::string profile_report(unsigned max_lines = 20);
+    void record_fragment(Fragment& fragment, PressureAdjacent adj);
+    void add_fragment(const Fragment& fragment, PressureAdjacent adj);
+    void compile();
+    void store();
+    void reset();
+    void save_state(std::vector<Pressure>& state) {state.assign(value.begin(), value.begin() + vented_end);}
+    bool state_equal(const std::vector<Pressure>& state) {return state.size() == vented_end && std::equal(state.begin(), state.end(), value.begin());}
+    bool load_state(const std::vector<Pressure>& state);
+    uint64_t get_signature() {return signature;}
 
-        for (FastSimPipe2& p : pipe2)
-            p.sim();
-        for (FastSimPipe3& p : pipe3)
-            p.sim();
-        for (FastSimPipe4& p : pipe4)
-            p.sim();
-        for (FastSimValve& p : valves)
-            p.sim();
-        for (CircuitPressure* con : sources)
-        {
-            int64_t val = (100 * PRESSURE_SCALAR - con->value) / 2;
-            steam_used += val;
-            con->move(val);
-        }
+    unsigned get_component_count() {return component_nodes.size();}
+    unsigned get_component_nodes(unsigned component) {return component_nodes[component];}
+    bool is_component_frozen(unsigned component) {return component_frozen[component];}
 
-        for (CircuitPressure* con : fast_pressures)
-            con->post();
-        for (CircuitPressure* con : fast_pressures_vent)
-            con->post();
-    }
+    void sim();
     void clean()
     {
-        for (CircuitPressure* con : fast_pressures)
-            con->clean();
+        for (uint32_t i = 0; i < internal_count; i++)
+        {
+            if (value[i] < 0)
+                value[i] = 0;
+            if (value[i] > (PRESSURE_SCALAR * 100))
+                value[i] = (PRESSURE_SCALAR * 100);
+        }
+        wake_all();
+        store();
     }
     
     void reset_steam_used() {steam_used = 0;}
+    void add_steam_used(int64_t steam) {steam_used += steam;}
+    int64_t get_steam_used_raw() {return steam_used;}
     int64_t get_steam_used() {return std::min(int64_t(INT32_MAX), (steam_used + PRESSURE_SCALAR / 2) / PRESSURE_SCALAR);}
 };
 
@@ -350,10 +572,14 @@ typedef uint8_t PixelData[24][24*8];
 class CircuitElement
 {
 public:
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr, size_t size);
+
     SaveObject* save(void);
     virtual void save(SaveObjectMap*) = 0;
     static CircuitElement* load(SaveObject*, unsigned version, bool read_only = false);
     virtual CircuitElement* copy() = 0;
+    virtual CircuitElement* copy_unelaborated() {return copy();}    // elaborate has to run on it before use
     virtual ~CircuitElement(){}
 
 
@@ -420,13 +646,12 @@ public:
 
 class CircuitElementValve : public CircuitElement
 {
-    const int resistence = 8;
-
     Pressure pressure = 0;
     int openness = 0;
     int moved_pos = 0;
 
 public:
+    static const int resistence = 8;
     DirFlip dir_flip;
 
     CircuitElementValve(){}
@@ -446,13 +671,25 @@ public:
     void render_prep(PressureAdjacent adj);
 
     void sim_prep(PressureAdjacent adj, FastSim& fast_sim);
-    void sim(PressureAdjacent adj);
     CircuitElementType get_type() {return CIRCUIT_ELEMENT_TYPE_VALVE;}
     void rotate(bool clockwise) {dir_flip = dir_flip.rotate(clockwise);};
     void flip(bool vertically) {dir_flip = dir_flip.flip(vertically);};
     unsigned get_cost() {return 10;};
 };
 
+inline bool FastSim::FastSimValve::sim(const Pressure* value, Pressure* move_next)
+{
+    int64_t mul = (value[n] - value[s]);
+    if (mul < 0)
+        mul = 0;
+
+                                                            // base resistence is 8 pipes
+    Pressure mov = (int64_t(value[w] - value[e]) * mul) / (int64_t(100) * 2 * CircuitElementValve::resistence * PRESSURE_SCALAR);
+    move_next[w] -= mov;
+    move_next[e] += mov;
+    return mov;
+}
+
 class CircuitElementSource : public CircuitElement
 {
 
@@ -507,6 +744,7 @@ public:
     std::string name = "";
     Level* level = NULL;;
     Circuit* circuit = NULL;
+    bool shared = false;                // circuit is a template owned by the LevelSet
     bool custom = false;
     bool read_only = false;
     PixelData icon_pixels;
@@ -514,12 +752,13 @@ public:
 
     CircuitElementSubCircuit(DirFlip dir_flip_, int level_index_, LevelSet* level_set, bool read_only_ = false);
     CircuitElementSubCircuit(SaveObjectMap*, unsigned version, bool read_only_ = false);
-    CircuitElementSubCircuit(CircuitElementSubCircuit& other);
+    CircuitElementSubCircuit(CircuitElementSubCircuit& other, bool elaborated = true);
     ~CircuitElementSubCircuit();
 
     void save(SaveObjectMap*);
     virtual uint16_t get_desc();
     virtual CircuitElement* copy();
+    virtual CircuitElement* copy_unelaborated();
     void reset();
     void elaborate(LevelSet* level_set, std::set<unsigned> seen = {});
     void retire();
@@ -563,6 +802,46 @@ public:
     void flip(bool vertically);
 };
 
+class CircuitPrepCache
+{
+public:
+    class Cell
+    {
+    public:
+        CircuitElement* element = NULL;
+        uint16_t type = 0;
+        uint16_t desc = 0;
+        unsigned connections = 0;
+        Circuit* subcircuit = NULL;
+        uint64_t edit_stamp = 0;
+        FastSim::Fragment fragment;
+    };
+    std::vector<Cell> cells;            // 9x9, what each cell added on the last prep
+    std::vector<Cell> old_cells;
+    FastSim scratch;
+};
+
+class CircuitUndo                       // one step of history, what to put back to undo it
+{
+public:
+    class Cell
+    {
+    public:
+        XYPos pos;
+        CircuitElement* element;
+        Cell(XYPos pos_, CircuitElement* element_):
+            pos(pos_),
+            element(element_)
+        {}
+    };
+    std::vector<Cell> cells;            // only the cells the step changed, elements are unelaborated
+    bool has_signs = false;
+    std::list<Sign> signs;
+    size_t memory = 0;                  // rough size of everything held
+
+    ~CircuitUndo();
+};
+
 class Circuit
 {
 public:
@@ -589,19 +868,27 @@ public:
     bool blocked[9][9] = {{false}};
 
     bool fast_prepped = false;
+    static std::atomic<uint64_t> edit_stamps;
+    uint64_t edit_stamp = ++edit_stamps;    // new with every edit that changes what sim_prep adds
+    CircuitPrepCache* prep_cache = NULL;
+    static bool cache_prep;             // relink cells unchanged since the last prep rather than walking them
     std::vector<FastFunc> fast_funcs;
 
     FastSim fast_sim;
     
-    std::list<Circuit*> undo_list;
-    std::list<Circuit*> redo_list;
+    std::list<CircuitUndo*> undo_list;
+    std::list<CircuitUndo*> redo_list;
+    CircuitUndo* history_base = NULL;   // every cell and sign as of the last checkpoint
+    bool history_open = false;          // changes since the checkpoint are an edit, not housekeeping
+    size_t history_memory = 0;
+    static size_t history_memory_limit; // oldest steps are dropped beyond this
 
 
     Pressure last_vented = 0;
     Pressure last_moved = 0;
 
     Circuit(SaveObjectMap* omap, unsigned version);
-    Circuit(Circuit& other);
+    Circuit(Circuit& other, bool elaborated = true);     // unelaborated copies need elaborate before use
     Circuit();
     ~Circuit();
 
@@ -629,13 +916,22 @@ public:
 
     void render_prep();
 
+    void sim_prep_touched();
+    void sim_prep_connections(PressureAdjacent adj, FastSim& fast_sim);
     void sim_prep(PressureAdjacent adj, FastSim& fast_sim);
+    void sim_prep_cached(PressureAdjacent adj);
+    uint64_t get_edit_stamp();
     void prep(PressureAdjacent);
     void sim_pre(PressureAdjacent);
     void clean(){fast_sim.clean();}
+    void store_pressures(){fast_sim.store();}
     void remove_circles(LevelSet* level_set, std::set<unsigned> seen = {});
     void updated_ports() {fast_prepped = false;};
     void ammend();
+    void history_sync(bool record);
+    CircuitUndo* history_apply(CircuitUndo* step);
+    void history_clear(std::list<CircuitUndo*>& list);
+    bool same_as(Circuit& other);
     void force_element(XYPos pos, CircuitElement* element);
     void force_sign(Sign sign);
     bool is_blocked(XYPos pos);
@@ -646,6 +942,7 @@ public:
     bool contains_subcircuit_level(int level_index, LevelSet* level_set);
     unsigned get_cost();
     void reset_steam_used() {fast_sim.reset_steam_used();}
+    void add_steam_used(Circuit& other) {fast_sim.add_steam_used(other.fast_sim.get_steam_used_raw());}
     int64_t get_steam_used() {return fast_sim.get_steam_used();}
     SaveObjectList* save_forced();
     void copy_in(Circuit* other);
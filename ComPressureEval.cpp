@@ -0,0 +1,735 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <sys/resource.h>
+
+#include "Compress.h"
+#include "SaveState.h"
+#include "Level.h"
+
+// Headless scoring of saved designs.
+//
+// Accepts game save files (pressure.save), single design blobs as exported by the
+// game, either as plain text or compressed, and server databases (db.save). Every
+// playable level (or just the ones picked with -l) is scored with LevelSet::test_level
+// exactly as the server would.
+
+class Design
+{
+public:
+    std::string filename;
+    std::string text;
+    int level_index = -1;                   // design blobs carry the level they were made for
+    int version = -1;                       // set when the text is just the level set, as kept by the server
+
+    // The parsed save is freed whether or not a level set can be made from it
+
+    LevelSet* load(int* level_index_ = NULL) const
+    {
+        std::istringstream stream(text);
+        SaveObject* sobj = SaveObject::load(stream);
+        try
+        {
+            LevelSet* level_set;
+            if (version >= 0)
+                level_set = new LevelSet(sobj, version, true);
+            else
+            {
+                SaveObjectMap* omap = sobj->get_map();
+                unsigned version = 0;
+                if (omap->has_key("version"))
+                    version = omap->get_num("version");
+                if (level_index_ && omap->has_key("level_index"))
+                    *level_index_ = version_reindex_level(version, omap->get_num("level_index"));
+                level_set = new LevelSet(omap->get_item("levels"), version, true);
+            }
+            delete sobj;
+            return level_set;
+        }
+        catch (const std::runtime_error&)
+        {
+            delete sobj;
+            throw;
+        }
+    }
+};
+
+// Level-wide optimizations of the scorer, next to the ones in FastSim, Circuit and Level, so that
+// each can be turned off with -x
+
+static bool share_templates = true;         // LevelSet::share_subcircuits
+static bool split_segments = true;          // Level::advance_parallel
+
+class EvalJob
+{
+public:
+    Design* design;
+    int level_index;
+
+    bool done = false;
+    std::string name;
+    std::string error;
+    Pressure score = 0;
+    unsigned price = 0;
+    unsigned steam = 0;
+    PortTrace trace;
+
+    EvalJob(Design* design_, int level_index_):
+        design(design_),
+        level_index(level_index_)
+    {}
+
+    // Lanes score through LevelLanes instead, which keeps no history, so there is no trace. Traced
+    // runs are for comparing engines, so they split segments even on one core, and run the level
+    // once beforehand so that the preset snapshots are there to be jumped to.
+
+    void execute(unsigned test_thread_count, bool traced = false, bool lanes = false)
+    {
+        LevelSet* level_set = NULL;
+        try
+        {
+            level_set = design->load();
+            level_set->share_subcircuits = share_templates;
+            Level* level = level_set->levels[level_index];
+            level->circuit->elaborate(level_set);
+            name = level->name;
+            if (lanes)
+            {
+                level_set->reset(level_index);
+                LevelLanes level_lanes(*level);
+                level_lanes.add(level->circuit);
+                level_lanes.run();
+                score = level_lanes.lanes[0]->score;
+                price = level_lanes.lanes[0]->price;
+                steam = level_lanes.lanes[0]->steam;
+            }
+            else
+            {
+                unsigned threads = split_segments ? test_thread_count : 1;
+                if (traced)
+                {
+                    if (split_segments)
+                        threads = std::max(threads, 2u);
+                    PortTrace warm_up;
+                    if (Level::reuse_presets)
+                    {
+                        level->port_trace = &warm_up;
+                        level_set->test_level(level_index, 1);
+                        level->score_set = false;
+                    }
+                    level->port_trace = &trace;
+                }
+                level_set->test_level(level_index, threads);
+                level->port_trace = NULL;
+                score = level->last_score;
+                price = level->last_price;
+                steam = level->last_steam;
+            }
+        }
+        catch (const std::runtime_error& error_)
+        {
+            error = error_.what();
+        }
+        delete level_set;
+    }
+
+    void print()
+    {
+        if (!error.empty())
+            printf("%s\t%d\tERROR %s\n", design->filename.c_str(), level_index, error.c_str());
+        else
+            printf("%s\t%d\t%s\t%.3f\t%u\t%u\n", design->filename.c_str(), level_index, name.c_str(), (float)score / PRESSURE_SCALAR, price, steam);
+    }
+};
+
+class EvalPool
+{
+public:
+    std::vector<EvalJob*>& jobs;
+    std::atomic<unsigned> next_job = 0;
+    std::mutex print_mutex;
+    unsigned next_print = 0;
+    unsigned test_thread_count = 1;         // spare cores go to running the tests of a level in parallel
+    bool traced = false;
+    bool lanes = false;
+    bool quiet = false;
+
+    EvalPool(std::vector<EvalJob*>& jobs_):
+        jobs(jobs_)
+    {}
+
+    void worker()
+    {
+        while (true)
+        {
+            unsigned index = next_job++;
+            if (index >= jobs.size())
+                return;
+            jobs[index]->execute(test_thread_count, traced, lanes);
+
+            std::lock_guard<std::mutex> lock(print_mutex);
+            jobs[index]->done = true;
+            while (next_print < jobs.size() && jobs[next_print]->done)
+            {
+                if (!quiet)
+                    jobs[next_print]->print();
+                next_print++;
+            }
+            fflush(stdout);
+        }
+    }
+
+    void run(unsigned thread_count)
+    {
+        if (jobs.size() && thread_count > jobs.size())
+            test_thread_count = thread_count / jobs.size();
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < std::min(thread_count, unsigned(jobs.size())); i++)
+            threads.push_back(std::thread(&EvalPool::worker, this));
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+};
+
+static bool read_design(const char* filename, Design& design)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (file.fail())
+        return false;
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    std::string data = buffer.str();
+
+    size_t start = data.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos)
+        return false;
+    if (data[start] == '{')
+        design.text = data.substr(start);
+    else
+        design.text = decompress_string(data);
+    design.filename = filename;
+    return true;
+}
+
+// A server database holds the best design of every player for each level and score table
+
+static void read_database(Design& file, std::vector<Design*>& designs)
+{
+    std::istringstream stream(file.text);
+    SaveObjectMap* omap = SaveObject::load(stream)->get_map();
+    for (const char* table_name : {"levels", "levels_price", "levels_steam"})
+    {
+        if (!omap->has_key(table_name))
+            continue;
+        SaveObjectList* table_list = omap->get_item(table_name)->get_list();
+        for (unsigned level_index = 0; level_index < table_list->get_count(); level_index++)
+        {
+            SaveObjectList* score_list = table_list->get_item(level_index)->get_list();
+            for (unsigned i = 0; i < score_list->get_count(); i++)
+            {
+                SaveObjectMap* score_map = score_list->get_item(i)->get_map();
+                Design* design = new Design;
+                design->filename = file.filename + ":" + table_name + ":" + std::to_string(level_index) + ":" + std::to_string(score_map->get_num("id"));
+                design->text = decompress_string(score_map->get_string("design"));
+                design->level_index = level_index;
+                design->version = score_map->has_key("version") ? score_map->get_num("version") : 0;
+                designs.push_back(design);
+            }
+        }
+    }
+    delete omap;
+}
+
+static void read_help_designs(std::vector<Design*>& designs)
+{
+    for (int level_index = 0; level_index < LEVEL_COUNT; level_index++)
+    {
+        SaveObjectMap* desc = level_desc->get_item(level_index)->get_map();
+        if (!desc->has_key("help_design"))
+            continue;
+        Design* design = new Design;
+        design->filename = "help:" + std::to_string(level_index);
+        design->text = desc->get_item("help_design")->to_string();
+        design->level_index = level_index;
+        design->version = COMPRESSURE_VERSION;
+        designs.push_back(design);
+    }
+}
+
+// Differential testing of sim engines. Every job is scored once with the reference engine, a
+// plain tick loop of the scalar kernel with every optimization off, and once with the engine
+// picked on the command line, and the scores, prices, steam and the port pressures of every
+// tick must all match. Mismatched traces are played again, one job at a time, keeping the
+// pressures to find where they part. Turning optimizations off with -x narrows down which one
+// is at fault.
+
+class EngineSwitches
+{
+public:
+    FastSim::Kernel kernel = FastSim::KERNEL_SCALAR;
+    bool track_activity = false;
+    bool freeze_components = false;
+    bool cache_prep = false;
+    bool fast_forward_cycles = false;
+    bool reuse_presets = false;
+    bool run_bursts = false;
+    bool share_templates = false;
+    bool split_segments = false;
+
+    static EngineSwitches current()
+    {
+        EngineSwitches switches;
+        switches.kernel = FastSim::kernel;
+        switches.track_activity = FastSim::track_activity;
+        switches.freeze_components = FastSim::freeze_components;
+        switches.cache_prep = Circuit::cache_prep;
+        switches.fast_forward_cycles = Level::fast_forward_cycles;
+        switches.reuse_presets = Level::reuse_presets;
+        switches.run_bursts = Level::run_bursts;
+        switches.share_templates = ::share_templates;
+        switches.split_segments = ::split_segments;
+        return switches;
+    }
+
+    void use()
+    {
+        FastSim::kernel = kernel;
+        FastSim::track_activity = track_activity;
+        FastSim::freeze_components = freeze_components;
+        Circuit::cache_prep = cache_prep;
+        Level::fast_forward_cycles = fast_forward_cycles;
+        Level::reuse_presets = reuse_presets;
+        Level::run_bursts = run_bursts;
+        ::share_templates = share_templates;
+        ::split_segments = split_segments;
+    }
+};
+
+static unsigned compare(std::vector<EvalJob*>& jobs, unsigned thread_count, bool lanes)
+{
+    std::vector<EvalJob*> reference;
+    for (EvalJob* job : jobs)
+        reference.push_back(new EvalJob(job->design, job->level_index));
+
+    EngineSwitches chosen = EngineSwitches::current();
+    EngineSwitches plain;
+    auto use_reference = [&](bool reference_engine)
+    {
+        if (reference_engine)
+            plain.use();
+        else
+            chosen.use();
+    };
+
+    use_reference(true);
+    EvalPool reference_pool(reference);
+    reference_pool.traced = true;
+    reference_pool.quiet = true;
+    reference_pool.run(thread_count);
+
+    use_reference(false);
+    EvalPool pool(jobs);
+    pool.traced = !lanes;
+    pool.lanes = lanes;
+    pool.quiet = true;
+    pool.run(thread_count);
+
+    unsigned mismatches = 0;
+    unsigned errors = 0;
+    for (unsigned i = 0; i < jobs.size(); i++)
+    {
+        EvalJob& ref = *reference[i];
+        EvalJob& job = *jobs[i];
+        const char* filename = job.design->filename.c_str();
+        if (!ref.error.empty() || !job.error.empty())
+        {
+            if (ref.error != job.error)
+            {
+                printf("%s\t%d\tMISMATCH error \"%s\" vs \"%s\"\n", filename, job.level_index, ref.error.c_str(), job.error.c_str());
+                mismatches++;
+            }
+            else
+                errors++;
+            continue;
+        }
+        bool same_trace = lanes || (ref.trace.ticks == job.trace.ticks && ref.trace.hash == job.trace.hash);
+        if (ref.score == job.score && ref.price == job.price && ref.steam == job.steam && same_trace)
+            continue;
+        mismatches++;
+        printf("%s\t%d\tMISMATCH score %d vs %d, price %u vs %u, steam %u vs %u, %llu vs %llu ticks\n", filename, job.level_index,
+               ref.score, job.score, ref.price, job.price, ref.steam, job.steam, (unsigned long long)ref.trace.ticks, (unsigned long long)job.trace.ticks);
+        if (same_trace)
+            continue;
+
+        EvalJob ref_again(ref.design, ref.level_index);
+        EvalJob job_again(job.design, job.level_index);
+        ref_again.trace.keep = true;
+        job_again.trace.keep = true;
+        use_reference(true);
+        ref_again.execute(1, true);
+        use_reference(false);
+        job_again.execute(1, true);
+        std::vector<Pressure>& a = ref_again.trace.values;
+        std::vector<Pressure>& b = job_again.trace.values;
+        size_t diverge = std::mismatch(a.begin(), a.begin() + std::min(a.size(), b.size()), b.begin()).first - a.begin();
+        size_t tick = diverge / 4;
+        printf("%s\t%d\t  first differs at tick %zu:", filename, job.level_index, tick);
+        for (size_t p = tick * 4; p < tick * 4 + 4; p++)
+            printf(" %d/%d", p < a.size() ? a[p] : -1, p < b.size() ? b[p] : -1);
+        printf("\n");
+    }
+    use_reference(false);
+    printf("compare: %zu jobs, %u mismatches, %u errors in both\n", jobs.size(), mismatches, errors);
+
+    for (EvalJob* job : reference)
+        delete job;
+    return mismatches;
+}
+
+// Benchmark over the help designs shipped in Level.json. Each level is loaded, elaborated and
+// scored from scratch a few times and the fastest of each is kept. The output is JSON, so runs
+// from different commits can be compared by a script.
+
+class BenchResult
+{
+public:
+    int level_index;
+    std::string name;
+    double load_ms = 0;
+    double elaborate_ms = 0;
+    double score_ms = 0;
+    double edit_ms = 0;
+    uint64_t ticks = 0;
+    unsigned nodes = 0;
+    Pressure score = 0;
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string json_string(const std::string& str)
+{
+    std::string out = "\"";
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if ((unsigned char)c < 0x20)
+            continue;
+        out += c;
+    }
+    return out + "\"";
+}
+
+static void bench(unsigned reps)
+{
+    std::vector<BenchResult> results;
+    for (int level_index = 0; level_index < LEVEL_COUNT; level_index++)
+    {
+        SaveObjectMap* desc = level_desc->get_item(level_index)->get_map();
+        if (!desc->has_key("help_design"))
+            continue;
+        BenchResult result;
+        result.level_index = level_index;
+        LevelSet* level_set = NULL;
+        try
+        {
+            for (unsigned rep = 0; rep < reps; rep++)
+            {
+                auto start = std::chrono::steady_clock::now();
+                level_set = new LevelSet(desc->get_item("help_design"), COMPRESSURE_VERSION, true);
+                double load_ms = elapsed_ms(start);
+                level_set->share_subcircuits = share_templates;
+                Level* level = level_set->levels[level_index];
+
+                start = std::chrono::steady_clock::now();
+                level->circuit->elaborate(level_set);
+                double elaborate_ms = elapsed_ms(start);
+
+                // The same steps as LevelSet::test_level. Ticks skipped by fast forwarding or a
+                // preset snapshot are not simulated, so they are not counted.
+
+                start = std::chrono::steady_clock::now();
+                level_set->reset(level_index);
+                level->set_monitor_state(MONITOR_STATE_PLAY_ALL);
+                level->sim_ticks = 0;
+                while (!level->score_set)
+                    level->advance(1000);
+                double score_ms = elapsed_ms(start);
+                uint64_t ticks = level->sim_ticks;
+
+                // What the player waits on after every change: the edit itself, with its undo step,
+                // and the next tick, which preps the circuit again. The first pipe is taken out and
+                // then put back, and only putting it back is timed. The game never shares subcircuits,
+                // and shared ones must not be prepped again after ticking, so they are copied first.
+
+                level_set->share_subcircuits = false;
+                level->circuit->elaborate(level_set);
+                double edit_ms = 0;
+                XYPos pos;
+                for (pos.y = 0; pos.y < 9 && !edit_ms; pos.y++)
+                for (pos.x = 0; pos.x < 9 && !edit_ms; pos.x++)
+                {
+                    CircuitElement* element = level->circuit->elements[pos.y][pos.x];
+                    if (level->circuit->is_blocked(pos) || element->get_type() != CIRCUIT_ELEMENT_TYPE_PIPE)
+                        continue;
+                    Connections connections = ((CircuitElementPipe*)element)->connections;
+                    level->circuit->set_element_pipe(pos, CONNECTIONS_NONE);
+                    level->advance(1);
+                    start = std::chrono::steady_clock::now();
+                    level->circuit->set_element_pipe(pos, connections);
+                    level->advance(1);
+                    edit_ms = elapsed_ms(start);
+                }
+
+                if (!rep || load_ms < result.load_ms)
+                    result.load_ms = load_ms;
+                if (!rep || elaborate_ms < result.elaborate_ms)
+                    result.elaborate_ms = elaborate_ms;
+                if (!rep || score_ms < result.score_ms)
+                    result.score_ms = score_ms;
+                if (!rep || edit_ms < result.edit_ms)
+                    result.edit_ms = edit_ms;
+                result.name = level->name;
+                result.ticks = ticks;
+                result.score = level->last_score;
+                result.nodes = 0;
+                for (unsigned c = 0; c < level->circuit->fast_sim.get_component_count(); c++)
+                    result.nodes += level->circuit->fast_sim.get_component_nodes(c);
+                delete level_set;
+                level_set = NULL;
+            }
+        }
+        catch (const std::runtime_error& error)
+        {
+            fprintf(stderr, "%d: %s\n", level_index, error.what());
+            delete level_set;
+            continue;
+        }
+        fprintf(stderr, "%d %s: %.2fms load, %.2fms elaborate, %.2fms score, %.3fms edit\n", level_index, result.name.c_str(), result.load_ms, result.elaborate_ms, result.score_ms, result.edit_ms);
+        results.push_back(result);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double total_load_ms = 0;
+    double total_elaborate_ms = 0;
+    double total_score_ms = 0;
+    uint64_t total_ticks = 0;
+
+    printf("{\n  \"version\": %d,\n  \"kernel\": \"%s\",\n  \"reps\": %u,\n  \"levels\": [\n", COMPRESSURE_VERSION, FastSim::kernel == FastSim::KERNEL_AVX2 ? "avx2" : "scalar", reps);
+    for (unsigned i = 0; i < results.size(); i++)
+    {
+        BenchResult& r = results[i];
+        printf("    {\"level\": %d, \"name\": %s, \"nodes\": %u, \"load_ms\": %.3f, \"elaborate_ms\": %.3f, \"score_ms\": %.3f, \"edit_ms\": %.3f, \"ticks\": %llu, \"ticks_per_sec\": %.0f, \"score\": %.3f}%s\n",
+               r.level_index, json_string(r.name).c_str(), r.nodes, r.load_ms, r.elaborate_ms, r.score_ms, r.edit_ms, (unsigned long long)r.ticks, r.score_ms ? r.ticks * 1000 / r.score_ms : 0.0, (float)r.score / PRESSURE_SCALAR, i + 1 < results.size() ? "," : "");
+        total_load_ms += r.load_ms;
+        total_elaborate_ms += r.elaborate_ms;
+        total_score_ms += r.score_ms;
+        total_ticks += r.ticks;
+    }
+    printf("  ],\n  \"total\": {\"load_ms\": %.3f, \"elaborate_ms\": %.3f, \"score_ms\": %.3f, \"ticks\": %llu, \"ticks_per_sec\": %.0f},\n",
+           total_load_ms, total_elaborate_ms, total_score_ms, (unsigned long long)total_ticks, total_score_ms ? total_ticks * 1000 / total_score_ms : 0.0);
+    printf("  \"peak_rss_kb\": %ld\n}\n", usage.ru_maxrss);
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-l level]... [-k kernel] [-a] [-x optimization]... [-p] [-c] [-L] [-h] file...\n", name);
+    fprintf(stderr, "       %s -b [-r reps] [-k kernel] [-a] [-x optimization]... [-p]\n", name);
+    fprintf(stderr, "  scores every playable level in each save file, design blob or server database\n");
+    fprintf(stderr, "  and prints file, level, name, accuracy, price and steam, one line per level\n");
+    fprintf(stderr, "  -k  use the scalar or avx2 sim kernel\n");
+    fprintf(stderr, "  -a  track circuit activity and report the fraction of element updates skipped\n");
+    fprintf(stderr, "  -x  turn off one of: cycles, presets, bursts, frozen, prep-cache, templates, segments\n");
+    fprintf(stderr, "  -p  report which subcircuits the simulation time went to, by level and by position\n");
+    fprintf(stderr, "  -c  compare the chosen engine against a plain scalar one, tick by tick, and report mismatches\n");
+    fprintf(stderr, "  -L  with -c, score the chosen engine through LevelLanes (results only)\n");
+    fprintf(stderr, "  -h  add the built-in help designs to the files\n");
+    fprintf(stderr, "  -b  benchmark the built-in help designs and print the timings as JSON\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned thread_count = std::thread::hardware_concurrency();
+    std::set<int> chosen_levels;
+    std::vector<const char*> filenames;
+    bool run_bench = false;
+    unsigned bench_reps = 3;
+    bool run_compare = false;
+    bool compare_lanes = false;
+    bool help_designs = false;
+    Level::record_graph = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            thread_count = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+            chosen_levels.insert(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-k") && i + 1 < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "scalar"))
+                FastSim::kernel = FastSim::KERNEL_SCALAR;
+            else if (strcmp(argv[i], "avx2") || FastSim::kernel != FastSim::KERNEL_AVX2)
+            {
+                fprintf(stderr, "%s: kernel not available\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "-a"))
+            FastSim::track_activity = true;
+        else if (!strcmp(argv[i], "-x") && i + 1 < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "cycles"))
+                Level::fast_forward_cycles = false;
+            else if (!strcmp(argv[i], "presets"))
+                Level::reuse_presets = false;
+            else if (!strcmp(argv[i], "bursts"))
+                Level::run_bursts = false;
+            else if (!strcmp(argv[i], "frozen"))
+                FastSim::freeze_components = false;
+            else if (!strcmp(argv[i], "prep-cache"))
+                Circuit::cache_prep = false;
+            else if (!strcmp(argv[i], "templates"))
+                share_templates = false;
+            else if (!strcmp(argv[i], "segments"))
+                split_segments = false;
+            else
+            {
+                fprintf(stderr, "%s: no such optimization\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "-p"))
+            FastSim::profile = true;
+        else if (!strcmp(argv[i], "-b"))
+            run_bench = true;
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            bench_reps = std::max(atoi(argv[++i]), 1);
+        else if (!strcmp(argv[i], "-c"))
+            run_compare = true;
+        else if (!strcmp(argv[i], "-L"))
+            compare_lanes = true;
+        else if (!strcmp(argv[i], "-h"))
+            help_designs = true;
+        else if (argv[i][0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            filenames.push_back(argv[i]);
+    }
+    if (run_bench)
+    {
+        bench(bench_reps);
+        if (FastSim::profile)
+            fprintf(stderr, "%s", FastSim::profile_report().c_str());
+        return 0;
+    }
+    if (filenames.empty() && !help_designs)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!thread_count)
+        thread_count = 1;
+
+    std::vector<Design*> designs;
+    std::vector<EvalJob*> jobs;
+    std::vector<Design*> pending;
+    if (help_designs)
+        read_help_designs(pending);
+    for (const char* filename : filenames)
+    {
+        Design* design = new Design;
+        try
+        {
+            if (!read_design(filename, *design))
+            {
+                fprintf(stderr, "%s: could not read\n", filename);
+                delete design;
+                continue;
+            }
+            if (design->text.find("\"levels_price\"") != std::string::npos)
+            {
+                read_database(*design, pending);
+                delete design;
+                continue;
+            }
+            pending.push_back(design);
+        }
+        catch (const std::runtime_error& error)
+        {
+            fprintf(stderr, "%s: %s\n", filename, error.what());
+            delete design;
+        }
+    }
+
+    for (Design* design : pending)
+    {
+        const char* filename = design->filename.c_str();
+        LevelSet* level_set = NULL;
+        try
+        {
+            level_set = design->load(&design->level_index);
+            for (unsigned level_index = 0; level_index < level_set->levels.size(); level_index++)
+            {
+                if (design->version < 0 && !level_set->is_playable(level_index, LEVEL_COUNT))     // the rest were made for their level
+                    continue;
+                if (design->level_index >= 0 && design->level_index != int(level_index))
+                    continue;
+                if (!chosen_levels.empty() && chosen_levels.find(level_index) == chosen_levels.end())
+                    continue;
+                jobs.push_back(new EvalJob(design, level_index));
+            }
+            designs.push_back(design);
+        }
+        catch (const std::runtime_error& error)
+        {
+            fprintf(stderr, "%s: %s\n", filename, error.what());
+            delete design;
+        }
+        delete level_set;
+    }
+
+    unsigned mismatches = 0;
+    if (run_compare)
+        mismatches = compare(jobs, thread_count, compare_lanes);
+    else
+    {
+        EvalPool pool(jobs);
+        pool.run(thread_count);
+    }
+
+    if (FastSim::track_activity)
+    {
+        uint64_t count = FastSim::total_element_count;
+        uint64_t skipped = FastSim::total_element_skipped;
+        fprintf(stderr, "activity: skipped %llu of %llu element updates (%.1f%%)\n", (unsigned long long)skipped, (unsigned long long)count, count ? 100.0 * skipped / count : 0.0);
+    }
+    if (FastSim::profile)
+        fprintf(stderr, "%s", FastSim::profile_report().c_str());
+
+    for (EvalJob* job : jobs)
+        delete job;
+    for (Design* design : designs)
+        delete design;
+    return mismatches ? 2 : 0;
+}
@@ -1,11 +1,20 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <iostream>
 #include <string>
 #include <sstream>
 #include <fstream>
 #include <list>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <stdexcept>
 #include <signal.h>
 #include <codecvt>
@@ -14,8 +23,13 @@
 
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
 #include "Compress.h"
 #include "SaveState.h"
 #include "Level.h"
@@ -26,12 +40,14 @@ class Score
 {
 public:
     int64_t score = 0;
+    uint64_t seq = 0;                   // when the score was reached, the earlier of equal scores ranks higher
     std::string c_save;
     unsigned version = 0;
     Score(){}
     Score(const Score& other)
     {
         score = other.score;
+        seq = other.seq;
         c_save = other.c_save;
         version = other.version;
     }
@@ -59,11 +75,34 @@ public:
 };
     
 
+// Scores best first, equal scores in the order they were reached. The tree keeps subtree sizes
+// so a rank can be turned into an entry and back in O(log n).
+
+struct RankedScore
+{
+    int64_t score;
+    uint64_t seq;
+    uint64_t steam_id;
+};
+
+struct RankedScoreOrder
+{
+    bool operator()(const RankedScore& a, const RankedScore& b) const
+    {
+        if (a.score != b.score)
+            return a.score > b.score;
+        return a.seq < b.seq;
+    }
+};
+
+typedef __gnu_pbds::tree<RankedScore, __gnu_pbds::null_type, RankedScoreOrder, __gnu_pbds::rb_tree_tag, __gnu_pbds::tree_order_statistics_node_update> RankedScores;
+
 class ScoreTable
 {
 public:
-    std::multimap<int64_t, uint64_t, std::greater<int64_t>> sorted_scores;
+    RankedScores sorted_scores;
     std::map<uint64_t, Score> user_score;
+    uint64_t next_seq = 1;
     
     ~ScoreTable()
     {
@@ -76,7 +115,7 @@ public:
         for(auto const &score : sorted_scores)
         {
             SaveObjectMap* score_map = new SaveObjectMap;
-            uint64_t id = score.second;
+            uint64_t id = score.steam_id;
             score_map->add_num("id", id);
             score_map->add_num("score", user_score[id].score);
             if (!lite)
@@ -106,60 +145,46 @@ public:
         return user_score[steam_id].score;
     }
 
-    void add_score(uint64_t steam_id, int64_t score, SaveObject* sobj, unsigned version)
+    // Moves the player's entry to its new score, returns false if the score is worse than the one
+    // held and the design should not be kept
+
+    bool rank_score(uint64_t steam_id, int64_t score)
     {
         if ((user_score.find(steam_id) != user_score.end()) && (score < user_score[steam_id].score))
-            return;
+            return false;
 
-        if (score == user_score[steam_id].score)
-        {
-            user_score[steam_id].update_design(sobj, version);
-            return;
-        }
+        Score& entry = user_score[steam_id];
+        if (score == entry.score)
+            return true;
 
-        for (auto it = sorted_scores.begin(); it != sorted_scores.end(); )
-        {
-           if (it->second == steam_id)
-           {
-                if (it->first >= score)
-                    return;
-                it = sorted_scores.erase(it);
-                break;
-           }
-           else
-               ++it;
-        }
-        sorted_scores.insert({score, steam_id});
-        user_score[steam_id].score = score;
-        user_score[steam_id].update_design(sobj, version);
+        sorted_scores.erase(RankedScore{entry.score, entry.seq, steam_id});
+        entry.score = score;
+        entry.seq = next_seq++;
+        sorted_scores.insert(RankedScore{entry.score, entry.seq, steam_id});
+        return true;
     }
 
-    void add_score(uint64_t steam_id, int64_t score, std::string& sobj, unsigned version)
+    void add_score(uint64_t steam_id, int64_t score, SaveObject* sobj, unsigned version)
     {
-        if ((user_score.find(steam_id) != user_score.end()) && (score < user_score[steam_id].score))
-            return;
+        if (rank_score(steam_id, score))
+            user_score[steam_id].update_design(sobj, version);
+    }
 
-        if (score == user_score[steam_id].score)
-        {
+    void add_score(uint64_t steam_id, int64_t score, std::string& sobj, unsigned version)
+    {
+        if (rank_score(steam_id, score))
             user_score[steam_id].update_design(sobj, version);
-            return;
-        }
+    }
 
-        for (auto it = sorted_scores.begin(); it != sorted_scores.end(); )
-        {
-           if (it->second == steam_id)
-           {
-                if (it->first >= score)
-                    return;
-                it = sorted_scores.erase(it);
-                break;
-           }
-           else
-               ++it;
-        }
-        sorted_scores.insert({score, steam_id});
-        user_score[steam_id].score = score;
-        user_score[steam_id].update_design(sobj, version);
+    // Players with nothing but a zero score are known without being ranked
+
+    bool is_ranked(uint64_t steam_id, RankedScore& ranked)
+    {
+        auto it = user_score.find(steam_id);
+        if (it == user_score.end())
+            return false;
+        ranked = RankedScore{it->second.score, it->second.seq, steam_id};
+        return sorted_scores.find(ranked) != sorted_scores.end();
     }
 
    void fetch_scores(SaveObjectMap* omap, uint64_t user_id, std::set<uint64_t>& friends, Database& db, unsigned type, int visible);
@@ -263,6 +288,18 @@ public:
 };
 
 
+// The outcome of verifying a design, kept so an identical resubmission needs no simulation.
+// The key it was made from is kept compressed to tell apart keys whose hashes collide.
+
+class VerifiedScore
+{
+public:
+    std::string c_key;
+    int64_t score = 0;
+    int64_t price = 0;
+    int64_t steam = 0;
+};
+
 class Database
 {
 public:
@@ -274,6 +311,11 @@ public:
 
     std::map<uint64_t, std::string> paste_designs;
 
+    static const size_t VERIFIED_BYTES_LIMIT = 64 * 1024 * 1024;
+    std::map<uint64_t, VerifiedScore> verified;
+    std::deque<uint64_t> verified_order;        // oldest first, saved in this order so it carries over
+    size_t verified_bytes = 0;
+
     void update_name(uint64_t steam_id, std::string& steam_username)
     {
         players[steam_id].steam_username = steam_username;
@@ -401,6 +443,21 @@ public:
             }
         }
 
+        if (omap->has_key("verified"))
+        {
+            SaveObjectList* verified_list = omap->get_item("verified")->get_list();
+            for (unsigned i = 0; i < verified_list->get_count(); i++)
+            {
+                SaveObjectMap* verified_map = verified_list->get_item(i)->get_map();
+                VerifiedScore result;
+                result.c_key = verified_map->get_string("key");
+                result.score = verified_map->get_num("score");
+                result.price = verified_map->get_num("price");
+                result.steam = verified_map->get_num("steam");
+                insert_verified(verified_map->get_num("hash"), result);
+            }
+        }
+
     }
 
     SaveObject* save(bool lite)
@@ -471,6 +528,19 @@ public:
                 level_list->add_item(paste_map);
             }
             omap->add_item("pastes", level_list);
+            level_list = new SaveObjectList;
+            for(uint64_t hash : verified_order)
+            {
+                VerifiedScore& result = verified[hash];
+                SaveObjectMap* verified_map = new SaveObjectMap;
+                verified_map->add_num("hash", hash);
+                verified_map->add_string("key", result.c_key);
+                verified_map->add_num("score", result.score);
+                verified_map->add_num("price", result.price);
+                verified_map->add_num("steam", result.steam);
+                level_list->add_item(verified_map);
+            }
+            omap->add_item("verified", level_list);
         }
 
         omap->add_num("version", COMPRESSURE_VERSION);
@@ -666,112 +736,312 @@ public:
         }
         return false;
     }
+
+    // Everything a verification depends on: the design as save_one stores it, which carries the
+    // level_version of every level in it, the server version and, for a custom level, the tests
+    // it is run against. Must be made before verifying, save_one includes the score once set.
+
+    std::string verify_key(LevelSet* level_set, int level_index)
+    {
+        SaveObject* save_object = level_set->save_one(level_index);
+        std::string key = std::to_string(COMPRESSURE_VERSION) + " " + std::to_string(level_set->levels[level_index]->level_version) + " " + save_object->to_string();
+        delete save_object;
+        if (level_index >= LEVEL_COUNT)
+        {
+            for (CustomLevel &clevel :custom_levels)
+            {
+                if (clevel.name == level_set->levels[level_index]->name)
+                    key += clevel.sobj->get_list()->get_item(clevel.level_index)->to_string();
+            }
+        }
+        return key;
+    }
+
+    static uint64_t verify_hash(const std::string& key)
+    {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (unsigned char c : key)
+            hash = (hash ^ c) * 0x100000001b3ull;
+        return hash;
+    }
+
+    VerifiedScore* find_verified(const std::string& key)
+    {
+        auto it = verified.find(verify_hash(key));
+        if (it == verified.end() || it->second.c_key != compress_string(key))
+            return NULL;
+        return &it->second;
+    }
+
+    // The keys are whole designs, so the cache is bounded by their size. The oldest entries go
+    // first once it is over VERIFIED_BYTES_LIMIT.
+
+    void insert_verified(uint64_t hash, const VerifiedScore& result)
+    {
+        auto it = verified.find(hash);
+        if (it == verified.end())
+            verified_order.push_back(hash);
+        else
+            verified_bytes -= it->second.c_key.size();
+        verified[hash] = result;
+        verified_bytes += result.c_key.size();
+
+        while (verified_bytes > VERIFIED_BYTES_LIMIT && verified_order.size() > 1)
+        {
+            auto oldest = verified.find(verified_order.front());
+            verified_bytes -= oldest->second.c_key.size();
+            verified.erase(oldest);
+            verified_order.pop_front();
+        }
+    }
+
+    void add_verified(const std::string& key, int64_t score, int64_t price, int64_t steam)
+    {
+        VerifiedScore result;
+        result.c_key = compress_string(key);
+        result.score = score;
+        result.price = price;
+        result.steam = steam;
+        insert_verified(verify_hash(key), result);
+    }
 };
 
 
 
+// Workloads are executed a slice at a time on a WorkloadPool thread, away from the Database.
+// Anything that needs the Database is done on the network thread, when the workload is made
+// and in finish once execute returns true.
+
 class Workload
 {
 public:
     virtual ~Workload(){};
     virtual bool execute() = 0;
+    virtual void finish() {};
+    virtual SaveObject* save() {return NULL;};
 };
 
 class SubmitScore : public Workload
 {
 public:
+    class VerifyLevel
+    {
+    public:
+        int level_index;
+        std::string key;                // made before anything is verified, see Database::verify_key
+        bool done = false;
+        bool cached = false;            // the result came from an identical earlier submission
+    };
+
     LevelSet* level_set;
-    int current_level = 0;
+    int level_index;                    // the level submitted, the only one scored
+    int current_level = 0;              // the level being verified while init_level
     bool init_level = false;
     std::string steam_username;
     uint64_t steam_id;
     Database& db;
+    SaveObject* submission;
+    SimSnapshot* resume_snapshot = NULL;
+    int resume_level = -1;
+    std::vector<VerifyLevel> verify;    // lowest level first, the submitted level among them
+    unsigned verify_pos = 0;
     
+    // The other levels of the set come along for the subcircuits the submitted level uses. Those
+    // it does use are verified as well, so the design stored for it carries their scores, but
+    // only the submitted level is scored. Results of identical earlier verifications are reused.
+
     SubmitScore(Database& db_, SaveObjectMap* omap):
         db(db_)
     {
-        int level_index = omap->get_num("level_index");
+        submission = omap->dup();
+        level_index = omap->get_num("level_index");
+        current_level = level_index;
         unsigned version = 0;
         if (omap->has_key("version"))
             version = omap->get_num("version");
         level_set = new LevelSet(omap->get_item("levels"), version, true);
+        level_set->share_subcircuits = true;
         omap->get_string("steam_username", steam_username);
         steam_id = omap->get_num("steam_id");
         db.update_name(steam_id, steam_username);
+
+        if (!verifiable(level_index))
+            return;
+        for (unsigned i = 0; i < level_set->levels.size(); i++)
+        {
+            if (int(i) == level_index || (level_set->levels[level_index]->circuit->contains_subcircuit_level(i, level_set) && verifiable(i)))
+                verify.push_back({int(i), db.verify_key(level_set, i)});
+        }
+        for (VerifyLevel& v : verify)
+        {
+            VerifiedScore* result = db.find_verified(v.key);
+            if (result)
+            {
+                Level* level = level_set->levels[v.level_index];
+                level->last_score = result->score;
+                level->last_price = result->price;
+                level->last_steam = result->steam;
+                level->score_set = true;
+                v.done = true;
+                v.cached = true;
+            }
+        }
     }
 
     ~SubmitScore()
     {
         delete level_set;
+        delete submission;
+        delete resume_snapshot;
     }
-    void update_scores()
+
+    // Custom levels are only verified against the tests the Database has for them
+
+    bool verifiable(int index)
     {
-        for (unsigned level_index = 0; level_index < 10000; level_index++)
-        {
-            if (level_set->is_playable(level_index, LEVEL_COUNT))
-            {
-                Pressure score = level_set->levels[level_index]->last_score;
-                if (level_index >= LEVEL_COUNT)
-                {
-                    if (level_set->levels[level_index]->global)
-                    {
-                        SaveObject* save_object = level_set->save_one(level_index);
-                        if (score)
-                        {
-                            db.update_custom_score(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_score, save_object, COMPRESSURE_VERSION);
-                            db.update_custom_price(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_price, save_object, COMPRESSURE_VERSION);
-                            db.update_custom_steam(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_steam, save_object, COMPRESSURE_VERSION);
-                            printf("New score:%s - %f\n", level_set->levels[level_index]->name.c_str(), (float)score/65536);
-                        }
-                        delete save_object;
-                    }
-                }
-                else if (score)
-                {
-                    SaveObject* save_object = level_set->save_one(level_index);
-                    db.update_score(steam_id, level_index, level_set->levels[level_index]->last_score, save_object, COMPRESSURE_VERSION);
-                    db.update_price(steam_id, level_index, level_set->levels[level_index]->last_price, save_object, COMPRESSURE_VERSION);
-                    db.update_steam(steam_id, level_index, level_set->levels[level_index]->last_steam, save_object, COMPRESSURE_VERSION);
+        if (!level_set->is_playable(index, LEVEL_COUNT))
+            return false;
+        if (index >= LEVEL_COUNT)
+            return db.reinit_tests(level_set->levels[index]);
+        return true;
+    }
 
-                    printf("New score:%d - %f\n", level_index, (float)score/65536);
-                    delete save_object;
-                }
-            }
+    bool verified(int index)
+    {
+        for (VerifyLevel& v : verify)
+            if (v.level_index == index)
+                return v.done;
+        return false;
+    }
+
+    // Saved on shutdown so a restarted server carries on where it stopped. Finished levels keep
+    // their results and the level being verified is snapshotted mid test.
+
+    SaveObject* save()
+    {
+        SaveObjectMap* omap = new SaveObjectMap;
+        omap->add_item("submission", submission->dup());
+        omap->add_num("current_level", current_level);
+        SaveObjectList* slist = new SaveObjectList;
+        for (VerifyLevel& v : verify)
+        {
+            if (!v.done)
+                continue;
+            Level* level = level_set->levels[v.level_index];
+            SaveObjectMap* result = new SaveObjectMap;
+            result->add_num("level_index", v.level_index);
+            result->add_num("score", level->last_score);
+            result->add_num("price", level->last_price);
+            result->add_num("steam", level->last_steam);
+            slist->add_item(result);
+        }
+        omap->add_item("results", slist);
+        if (init_level)
+        {
+            SimSnapshot snapshot;
+            level_set->levels[current_level]->save_snapshot(snapshot);
+            omap->add_item("snapshot", snapshot.save());
         }
+        return omap;
     }
 
-    bool execute()
+    // Workloads saved by older servers may hold results of levels which are not verified any more,
+    // those are ignored
+
+    void resume(SaveObjectMap* omap)
     {
-        while (!level_set->is_playable(current_level, LEVEL_COUNT))
+        SaveObjectList* slist = omap->get_item("results")->get_list();
+        for (unsigned i = 0; i < slist->get_count(); i++)
         {
-            current_level++;
-            if (current_level >= 10000)
+            SaveObjectMap* result = slist->get_item(i)->get_map();
+            for (VerifyLevel& v : verify)
             {
-                update_scores();
-                return true;
+                if (v.level_index != result->get_num("level_index") || v.done)
+                    continue;
+                Level* level = level_set->levels[v.level_index];
+                level->last_score = result->get_num("score");
+                level->last_price = result->get_num("price");
+                level->last_steam = result->get_num("steam");
+                level->score_set = true;
+                v.done = true;
             }
         }
-        if (!init_level)
+        if (omap->has_key("snapshot"))
+        {
+            resume_snapshot = new SimSnapshot(omap->get_item("snapshot"));
+            resume_level = omap->get_num("current_level");
+        }
+    }
+    void update_scores()
+    {
+        if (!verified(level_index))
+            return;
+        Pressure score = level_set->levels[level_index]->last_score;
+        if (level_index >= LEVEL_COUNT)
         {
-            if (current_level >= LEVEL_COUNT)
+            if (level_set->levels[level_index]->global)
             {
-                if (!db.reinit_tests(level_set->levels[current_level]))
+                SaveObject* save_object = level_set->save_one(level_index);
+                if (score)
                 {
-                    current_level++;
-                    return false;
+                    db.update_custom_score(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_score, save_object, COMPRESSURE_VERSION);
+                    db.update_custom_price(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_price, save_object, COMPRESSURE_VERSION);
+                    db.update_custom_steam(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_steam, save_object, COMPRESSURE_VERSION);
+                    printf("New score:%s - %f\n", level_set->levels[level_index]->name.c_str(), (float)score/65536);
                 }
+                delete save_object;
             }
+        }
+        else if (score)
+        {
+            SaveObject* save_object = level_set->save_one(level_index);
+            db.update_score(steam_id, level_index, level_set->levels[level_index]->last_score, save_object, COMPRESSURE_VERSION);
+            db.update_price(steam_id, level_index, level_set->levels[level_index]->last_price, save_object, COMPRESSURE_VERSION);
+            db.update_steam(steam_id, level_index, level_set->levels[level_index]->last_steam, save_object, COMPRESSURE_VERSION);
+
+            printf("New score:%d - %f\n", level_index, (float)score/65536);
+            delete save_object;
+        }
+    }
+
+    void finish()
+    {
+        for (VerifyLevel& v : verify)
+        {
+            if (!v.done || v.cached)
+                continue;
+            Level* level = level_set->levels[v.level_index];
+            db.add_verified(v.key, level->last_score, level->last_price, level->last_steam);
+        }
+        update_scores();
+    }
+
+    bool execute()
+    {
+        if (!init_level)
+        {
+            while (verify_pos < verify.size() && verify[verify_pos].done)
+                verify_pos++;
+            if (verify_pos == verify.size())
+                return true;
+            current_level = verify[verify_pos].level_index;
             level_set->levels[current_level]->circuit->elaborate(level_set);
 
             level_set->reset(current_level);
             level_set->levels[current_level]->last_score = 0;
             level_set->levels[current_level]->best_score = 0;
+            if (resume_snapshot && resume_level == current_level)
+            {
+                level_set->levels[current_level]->restore_snapshot(*resume_snapshot);
+                delete resume_snapshot;
+                resume_snapshot = NULL;
+            }
             init_level = true;
         }
         level_set->levels[current_level]->advance(1000);
         if (level_set->levels[current_level]->score_set)
         {
-            current_level++;
+            verify[verify_pos].done = true;
             init_level = false;
         }
         return false;
@@ -813,21 +1083,6 @@ public:
             inbuf.append(buf, num_bytes_received);
         }
 
-        while (true)
-        {
-            ssize_t num_bytes_received = send(conn_fd, outbuf.c_str(), outbuf.length(), MSG_DONTWAIT);
-            if (num_bytes_received  == -1)
-            {
-                if (errno != EAGAIN && errno != EWOULDBLOCK)
-                    close();
-                break;
-            }
-            else if (num_bytes_received  == 0)
-            {
-                break;
-            }
-            outbuf.erase(0, num_bytes_received);
-        }
         while (true)
         {
             if (length < 0 && inbuf.length() >= 4)
@@ -1047,6 +1302,21 @@ public:
             else
                 break;
         }
+
+        // Replies go out straight away, the socket will not be reported writable again unless
+        // a send fills it up
+
+        while (conn_fd >= 0 && !outbuf.empty())
+        {
+            ssize_t num_bytes_sent = send(conn_fd, outbuf.c_str(), outbuf.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (num_bytes_sent == -1)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    close();
+                break;
+            }
+            outbuf.erase(0, num_bytes_sent);
+        }
         return resp;
     }
     
@@ -1061,6 +1331,99 @@ public:
 
 };
 
+// Runs workloads on their own threads, so verifying submissions neither holds up the network
+// loop nor takes turns with the others. A workload is run by one thread from start to end and
+// then queued in finished for the network thread to apply, which wakes when notify_fd is
+// readable. Stopping returns the workloads which have not finished, the ones cut short first.
+
+class WorkloadPool
+{
+public:
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Workload*> pending;
+    std::vector<Workload*> finished;
+    std::vector<std::thread> threads;
+    std::atomic<bool> stopping = false;
+    int notify_fd;
+
+    WorkloadPool(unsigned thread_count)
+    {
+        notify_fd = eventfd(0, EFD_NONBLOCK);
+        for (unsigned i = 0; i < thread_count; i++)
+            threads.push_back(std::thread(&WorkloadPool::worker, this));
+    }
+
+    ~WorkloadPool()
+    {
+        ::close(notify_fd);
+    }
+
+    void add(Workload* workload)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(workload);
+        wake.notify_one();
+    }
+
+    std::vector<Workload*> take_finished()
+    {
+        uint64_t count;
+        while (read(notify_fd, &count, sizeof(count)) > 0);
+        std::vector<Workload*> done;
+        std::lock_guard<std::mutex> lock(mutex);
+        done.swap(finished);
+        return done;
+    }
+
+    std::deque<Workload*> stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            wake.notify_all();
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+        threads.clear();
+        std::deque<Workload*> left;
+        left.swap(pending);
+        return left;
+    }
+
+    void worker()
+    {
+        sigset_t signals;
+        sigfillset(&signals);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [&]{return stopping || !pending.empty();});
+            if (stopping)
+                return;
+            Workload* workload = pending.front();
+            pending.pop_front();
+            lock.unlock();
+
+            bool done = false;
+            while (!done && !stopping)
+                done = workload->execute();
+
+            lock.lock();
+            if (done)
+            {
+                finished.push_back(workload);
+                uint64_t one = 1;
+                write(notify_fd, &one, sizeof(one));
+            }
+            else
+                pending.push_front(workload);
+        }
+    }
+};
+
 bool power_down = false;
 
 void sig_handler(int signo)
@@ -1073,9 +1436,94 @@ void sig_handler(int signo)
     printf("shutting down\n");
 }
 
+// Re-runs every stored design of the built in levels and reports any whose score no longer
+// matches. All designs in a table are simulated together as lanes sharing the level's tests.
+
+void rescore(Database& db, int only_level)
+{
+    const char* table_names[3] = {"score", "price", "steam"};
+    for (unsigned level_index = 0; level_index < LEVEL_COUNT && level_index < db.levels.size(); level_index++)
+    {
+        if (only_level >= 0 && level_index != unsigned(only_level))
+            continue;
+        ScoreTable* tables[3] = {&db.levels[level_index], NULL, NULL};
+        if (level_index < db.levels_price.size())
+            tables[1] = &db.levels_price[level_index];
+        if (level_index < db.levels_steam.size())
+            tables[2] = &db.levels_steam[level_index];
+
+        for (int table_index = 0; table_index < 3; table_index++)
+        {
+            if (!tables[table_index])
+                continue;
+            std::vector<LevelSet*> level_sets;
+            std::vector<uint64_t> ids;
+            std::vector<int64_t> expected;
+            LevelLanes* lanes = NULL;
+            unsigned errors = 0;
+            for (auto& entry : tables[table_index]->user_score)
+            {
+                try
+                {
+                    unsigned version;
+                    SaveObject* sobj = entry.second.get_design(version);
+                    LevelSet* level_set = new LevelSet(sobj, version, true);
+                    delete sobj;
+                    level_set->share_subcircuits = true;
+                    Level* level = level_set->levels[level_index];
+                    level->circuit->elaborate(level_set);
+                    level_set->reset(level_index);
+                    if (!lanes)
+                        lanes = new LevelLanes(*level);
+                    if (!lanes->fits(*level))
+                    {
+                        printf("rescore: level %u %s %llu: tests differ\n", level_index, table_names[table_index], (unsigned long long)entry.first);
+                        delete level_set;
+                        errors++;
+                        continue;
+                    }
+                    lanes->add(level->circuit);
+                    level_sets.push_back(level_set);
+                    ids.push_back(entry.first);
+                    expected.push_back(entry.second.score);
+                }
+                catch (const std::runtime_error& error)
+                {
+                    printf("rescore: level %u %s %llu: %s\n", level_index, table_names[table_index], (unsigned long long)entry.first, error.what());
+                    errors++;
+                }
+            }
+            if (!lanes)
+                continue;
+            lanes->run();
+
+            unsigned mismatches = 0;
+            for (unsigned i = 0; i < ids.size(); i++)
+            {
+                LevelLanes::Lane* lane = lanes->lanes[i];
+                int64_t got = lane->score;
+                if (table_index == 1)
+                    got = INT64_MAX - lane->price;
+                if (table_index == 2)
+                    got = INT64_MAX - lane->steam;
+                if (got != expected[i])
+                {
+                    printf("rescore: level %u %s %llu: stored %lld, got %lld\n", level_index, table_names[table_index], (unsigned long long)ids[i], (long long)expected[i], (long long)got);
+                    mismatches++;
+                }
+            }
+            printf("rescore: level %u %s: %zu designs, %u mismatches, %u errors\n", level_index, table_names[table_index], ids.size(), mismatches, errors);
+            delete lanes;
+            for (LevelSet* level_set : level_sets)
+                delete level_set;
+        }
+    }
+}
+
 int main(int argc, char *argv[])
 {
     Database db;
+    Level::record_graph = false;
     signal(SIGUSR1, sig_handler);
     signal(SIGINT,  sig_handler);
     signal(SIGTERM, sig_handler);
@@ -1095,6 +1543,20 @@ int main(int argc, char *argv[])
         std::cerr << error.what() << "\n";
     }
 
+    if (argc >= 2 && !strcmp(argv[1], "--rescore"))
+    {
+        rescore(db, argc >= 3 ? atoi(argv[2]) : -1);
+        return 0;
+    }
+
+    if (argc >= 2 && !strcmp(argv[1], "--profile"))
+    {
+        FastSim::profile = true;
+        rescore(db, argc >= 3 ? atoi(argv[2]) : -1);
+        printf("%s", FastSim::profile_report(40).c_str());
+        return 0;
+    }
+
     if (argc >= 2) 
     {
         db.levels[atoi(argv[1])].clear();
@@ -1123,78 +1585,137 @@ int main(int argc, char *argv[])
         perror("bind");
         return 1;
     }
-    if(listen(sockid,10)==-1)
+    if(listen(sockid,SOMAXCONN)==-1)
     {
         perror("listen");
         return 1;
     }
     
     
-    std::list<Connection> conns;
-    std::list<Workload*> workloads;
+    // Descriptors are only limited by what the process may open, so raise the soft limit as far
+    // as it goes
 
-    time_t old_time = 0;
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max)
+    {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
 
-    while(true)
+    // Sockets are watched edge triggered: a connection is only serviced when epoll reports it,
+    // and each time it reads and writes until the socket would block
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1)
+    {
+        perror("epoll_create1");
+        return 1;
+    }
+    struct epoll_event listen_event = {};
+    listen_event.events = EPOLLIN | EPOLLET;
+    listen_event.data.fd = sockid;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockid, &listen_event) == -1)
+    {
+        perror("epoll_ctl");
+        return 1;
+    }
+    std::vector<struct epoll_event> events(256);
+    bool accept_ready = true;
+
+    std::unordered_map<int, Connection> conns;
+    WorkloadPool workloads(std::max(std::thread::hardware_concurrency(), 1u));
+    struct epoll_event notify_event = {};
+    notify_event.events = EPOLLIN | EPOLLET;
+    notify_event.data.fd = workloads.notify_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, workloads.notify_fd, &notify_event) == -1)
+    {
+        perror("epoll_ctl");
+        return 1;
+    }
+
+    try 
     {
-        if (workloads.empty())
+        std::ifstream loadfile("workloads.save");
+        if (!loadfile.fail() && !loadfile.eof())
         {
-            fd_set w_fds;
-            fd_set r_fds;
-            struct timeval timeout;
-            timeout.tv_sec = 5;
-            timeout.tv_usec = 0;
-
-            FD_ZERO(&r_fds);
-            FD_ZERO(&w_fds);
-            FD_SET(sockid, &r_fds);
-            
-            for (Connection &conn :conns)
+            SaveObjectList* slist = SaveObject::load(loadfile)->get_list();
+            for (unsigned i = 0; i < slist->get_count(); i++)
             {
-                FD_SET(conn.conn_fd, &r_fds);
-                if (!conn.outbuf.empty())
-                    FD_SET(conn.conn_fd, &w_fds);
+                SaveObjectMap* omap = slist->get_item(i)->get_map();
+                SubmitScore* workload = new SubmitScore(db, omap->get_item("submission")->get_map());
+                workload->resume(omap);
+                workloads.add(workload);
             }
-            
-            select(1024, &r_fds, &w_fds, NULL, &timeout);
+            printf("resumed %u workloads\n", slist->get_count());
+            delete slist;
         }
+    }
+    catch (const std::runtime_error& error)
+    {
+        std::cerr << error.what() << "\n";
+    }
+    remove("workloads.save");
 
-        while (true)
+    time_t old_time = 0;
+
+    while(true)
+    {
+        int event_count = epoll_wait(epoll_fd, events.data(), events.size(), 5000);
+        std::vector<int> ready;
+        for (int i = 0; i < event_count; i++)
+        {
+            if (events[i].data.fd == sockid)
+                accept_ready = true;
+            else if (events[i].data.fd != workloads.notify_fd)
+                ready.push_back(events[i].data.fd);
+        }
+
+        // A full descriptor table leaves connections waiting, they are tried again every time
+        // round until they are all taken
+
+        while (accept_ready)
         {
             int conn_fd = accept(sockid,(struct sockaddr *)&clientaddr, &len);
             if (conn_fd == -1)
+            {
+                accept_ready = (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM);
                 break;
-            if (conn_fd >= 1024)
+            }
+            struct epoll_event conn_event = {};
+            conn_event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            conn_event.data.fd = conn_fd;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_fd, &conn_event) == -1)
+            {
                 ::close(conn_fd);
-            conns.push_back(conn_fd);
+                continue;
+            }
+            conns.emplace(conn_fd, conn_fd);
+            ready.push_back(conn_fd);
         }
 
-        for (std::list<Connection>::iterator it = conns.begin(); it != conns.end();)
+        for (int conn_fd : ready)
         {
-            Connection& conn = (*it);
+            auto it = conns.find(conn_fd);
+            if (it == conns.end())
+                continue;
+            Connection& conn = it->second;
             Workload* new_workload = conn.recieve(db);
             if (new_workload)
             {
-                workloads.push_back(new_workload);
+                workloads.add(new_workload);
             }
             if (conn.conn_fd < 0)
             {
-                it = conns.erase(it);
+                conns.erase(it);
             }
-            else
-                it++;
         }
+        if (event_count == int(events.size()))
+            events.resize(events.size() * 2);
 
-        for (std::list<Workload*>::iterator it = workloads.begin();it != workloads.end();)
+        for (Workload* workload : workloads.take_finished())
         {
-            Workload* workload = (*it);
-            if (workload->execute())
-            {
-                delete workload;
-                it = workloads.erase(it);
-            }
-            else
-                it++;
+            workload->finish();
+            delete workload;
         }
 
         fflush(stdout);
@@ -1216,7 +1737,28 @@ int main(int argc, char *argv[])
             delete savobj_lite;
         }
     }
+    close(epoll_fd);
     close(sockid);
+    std::deque<Workload*> unfinished = workloads.stop();
+    for (Workload* workload : workloads.take_finished())
+    {
+        workload->finish();
+        delete workload;
+    }
+    if (!unfinished.empty())
+    {
+        SaveObjectList* slist = new SaveObjectList;
+        for (Workload* workload : unfinished)
+        {
+            SaveObject* sobj = workload->save();
+            if (sobj)
+                slist->add_item(sobj);
+            delete workload;
+        }
+        std::ofstream outfile ("workloads.save");
+        slist->save(outfile);
+        delete slist;
+    }
     {
         std::ofstream outfile ("db.save");
         SaveObject* savobj = db.save(false);
@@ -1231,44 +1773,76 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+// The graph samples 200 ranks and the list holds only the top visible and friends, so neither
+// needs a walk over the whole table. Entries for nobody and for CHARLES_ID are left out of both.
+
 void ScoreTable::fetch_scores(SaveObjectMap* omap, uint64_t user_id, std::set<uint64_t>& friends, Database& db, unsigned type, int visible)
 {
     SaveObjectList* friend_scores = new SaveObjectList;
 
-    std::vector<int64_t> scores;
-
-    int i = 0;
-    for(auto const &score : sorted_scores)
+    std::vector<size_t> hidden;
+    for (uint64_t id : std::set<uint64_t>{0, CHARLES_ID})
     {
-        if (!score.second || (score.second == CHARLES_ID))
-            continue;
-
-        int64_t s = type ? (INT64_MAX - score.first) : score.first;
+        RankedScore ranked;
+        if (is_ranked(id, ranked))
+            hidden.push_back(sorted_scores.order_of_key(ranked));
+    }
+    std::sort(hidden.begin(), hidden.end());
 
-        scores.push_back(s);
-        bool fri = (friends.find(score.second) != friends.end()) || (score.second == user_id);
-        if ((user_id == CHARLES_ID )|| fri || (i < visible))
+    std::vector<RankedScore> listed;
+    if (user_id == CHARLES_ID)
+        listed.assign(sorted_scores.begin(), sorted_scores.end());
+    else
+    {
+        int i = 0;
+        size_t top_end = 0;
+        for (auto it = sorted_scores.begin(); it != sorted_scores.end() && i < visible; ++it, top_end++)
         {
-            if (score.second == CHARLES_ID || score.second == 0)
+            if (!it->steam_id || (it->steam_id == CHARLES_ID))
                 continue;
-            SaveObjectMap* omap = new SaveObjectMap;
-            omap->add_num("steam_id", score.second);
-            omap->add_string("steam_username", db.players[score.second].steam_username);
-            omap->add_num("score", s);
-            omap->add_num("visible", fri || (user_id == CHARLES_ID));
-            friend_scores->add_item(omap);
+            listed.push_back(*it);
+            i++;
         }
-        i++;
+        std::set<uint64_t> ids = friends;
+        ids.insert(user_id);
+        for (uint64_t id : ids)
+        {
+            RankedScore ranked;
+            if (is_ranked(id, ranked) && sorted_scores.order_of_key(ranked) >= top_end)
+                listed.push_back(ranked);
+        }
+        std::sort(listed.begin(), listed.end(), RankedScoreOrder());
+    }
+
+    for (RankedScore& score : listed)
+    {
+        if (score.steam_id == CHARLES_ID || score.steam_id == 0)
+            continue;
+        int64_t s = type ? (INT64_MAX - score.score) : score.score;
+        bool fri = (friends.find(score.steam_id) != friends.end()) || (score.steam_id == user_id);
+        SaveObjectMap* omap = new SaveObjectMap;
+        omap->add_num("steam_id", score.steam_id);
+        omap->add_string("steam_username", db.players[score.steam_id].steam_username);
+        omap->add_num("score", s);
+        omap->add_num("visible", fri || (user_id == CHARLES_ID));
+        friend_scores->add_item(omap);
     }
 
     SaveObjectList* score_list = new SaveObjectList;
 
-    unsigned count = scores.size();
+    size_t count = sorted_scores.size() - hidden.size();
     for (unsigned i = 0; i < 200; i++)
     {
         int64_t result = 0;
         if (count)
-            result = scores[(i * count) / 200];
+        {
+            size_t index = (i * count) / 200;
+            for (size_t h : hidden)
+                if (index >= h)
+                    index++;
+            RankedScore score = *sorted_scores.find_by_order(index);
+            result = type ? (INT64_MAX - score.score) : score.score;
+        }
         score_list->add_num(result);
 
     }
@@ -587,35 +587,118 @@ void GameState::advance()
     }
     deal_with_design_fetch();
 
-    int count = pow(1.2, game_speed) * 2;
-    if (game_speed == 0)
-        count = ((frame_index % 20) == 0);
-    if (game_speed == 1)
-        count = ((frame_index % 10) == 0);
-    if (game_speed == 2)
-        count = ((frame_index % 2) == 0);
-    if (game_speed == 3)
-        count = 1;
-    if (game_speed == 4)
-        count = 2;
-    if (game_speed == 5)
-        count = 3;
+    if (!current_level->server_refreshed && !current_level_set_is_inspected && current_level->best_design)
+    {
+        current_level->server_refreshed = true;
+        score_submit(current_level_index, false);
+    }
 
+    if (current_level->best_score_set && (test_mode == TEST_MODE_ACCURACY) && !current_level_set_is_inspected)
+    {
+        current_level->best_score_set = false;
+        edited_level_set->record_best_score(current_level_index);
+        score_submit(current_level_index, false);
+        time_last_progress = SDL_GetTicks();
+    }
+    if (current_level->best_price_set && (test_mode == TEST_MODE_PRICE) && !current_level_set_is_inspected)
+    {
+        current_level->best_price_set = false;
+        edited_level_set->record_best_score(current_level_index);
+        score_submit(current_level_index, false);
+        time_last_progress = SDL_GetTicks();
+    }
+    if (current_level->best_steam_set && (test_mode == TEST_MODE_STEAM) && !current_level_set_is_inspected)
+    {
+        current_level->best_steam_set = false;
+        edited_level_set->record_best_score(current_level_index);
+        score_submit(current_level_index, false);
+        time_last_progress = SDL_GetTicks();
+    }
+}
+
+// The simulation runs on its own thread, so a slow frame does not hold it up and a busy
+// simulation does not drop frames. It keeps the old 10ms period: each period owes the ticks
+// the game speed asks for, run in slices of up to 2000 with sim_mutex held. Between slices the
+// main thread gets the lock if it is waiting, for its events and bookkeeping and to copy what it
+// is about to draw, see capture_view; the drawing itself runs without the lock. Periods
+// missed while the lock was held are caught up, up to 100ms worth. If the ticks of a period
+// take over 20ms of simulation the rest are dropped, and after a few such periods in a row the
+// game speed is lowered.
 
+void GameState::start_sim()
+{
+    sim_quit = false;
+    sim_thread = std::thread(&GameState::sim_loop, this);
+}
+
+void GameState::stop_sim()
+{
+    sim_quit = true;
+    sim_thread.join();
+}
+
+void GameState::lock_sim()
+{
+    sim_waiting = true;
+    sim_mutex.lock();
+    sim_waiting = false;
+}
+
+void GameState::unlock_sim()
+{
+    sim_mutex.unlock();
+}
+
+void GameState::sim_loop()
+{
+    unsigned period_index = 0;
+    unsigned next_period = SDL_GetTicks();
+
+    while (!sim_quit)
     {
+        unsigned time = SDL_GetTicks();
+        if (!SDL_TICKS_PASSED(time, next_period))
+        {
+            SDL_Delay(next_period - time);
+            continue;
+        }
+        if (SDL_TICKS_PASSED(time, next_period + 100))
+            next_period = time;
+        next_period += 10;
+        period_index++;
+
+        std::unique_lock<std::mutex> lock(sim_mutex);
+
+        int count = pow(1.2, game_speed) * 2;
+        if (game_speed == 0)
+            count = ((period_index % 20) == 0);
+        if (game_speed == 1)
+            count = ((period_index % 10) == 0);
+        if (game_speed == 2)
+            count = ((period_index % 2) == 0);
+        if (game_speed == 3)
+            count = 1;
+        if (game_speed == 4)
+            count = 2;
+        if (game_speed == 5)
+            count = 3;
+
         if (skip_to_next_subtest)
         {
             count = current_level->substep_count - current_level->substep_index;
         }
         if (!count)
             current_level->advance(0);
+        unsigned busy = 0;
         while (count)
         {
             int subcount = count < 2000 ? count : 2000;
+            unsigned slice_start = SDL_GetTicks();
             current_level->advance(subcount);
+            busy += SDL_GetTicks() - slice_start;
             count -= subcount;
             debug_simticks += subcount;
-            if (SDL_TICKS_PASSED(SDL_GetTicks(), time + 20))
+            if (busy > 20)
             {
                 if (!skip_to_next_subtest)
                 {
@@ -629,6 +712,13 @@ void GameState::advance()
             {
                 late_frames = 0;
             }
+            if (count && sim_waiting)
+            {
+                lock.unlock();
+                while (sim_waiting)
+                    std::this_thread::yield();
+                lock.lock();
+            }
         }
         if (!count)
         {
@@ -637,33 +727,6 @@ void GameState::advance()
         }
         current_level->circuit->clean();
     }
-    if (!current_level->server_refreshed && !current_level_set_is_inspected && current_level->best_design)
-    {
-        current_level->server_refreshed = true;
-        score_submit(current_level_index, false);
-    }
-
-    if (current_level->best_score_set && (test_mode == TEST_MODE_ACCURACY) && !current_level_set_is_inspected)
-    {
-        current_level->best_score_set = false;
-        edited_level_set->record_best_score(current_level_index);
-        score_submit(current_level_index, false);
-        time_last_progress = SDL_GetTicks();
-    }
-    if (current_level->best_price_set && (test_mode == TEST_MODE_PRICE) && !current_level_set_is_inspected)
-    {
-        current_level->best_price_set = false;
-        edited_level_set->record_best_score(current_level_index);
-        score_submit(current_level_index, false);
-        time_last_progress = SDL_GetTicks();
-    }
-    if (current_level->best_steam_set && (test_mode == TEST_MODE_STEAM) && !current_level_set_is_inspected)
-    {
-        current_level->best_steam_set = false;
-        edited_level_set->record_best_score(current_level_index);
-        score_submit(current_level_index, false);
-        time_last_progress = SDL_GetTicks();
-    }
 }
 
 void GameState::audio()
@@ -1281,11 +1344,11 @@ void GameState::render_grid(int scale, XYPos grid_offset)
         render_texture(src_rect, dst_rect);
     }
 
-    if ((current_level->tests[current_level->test_index].sim_points.size() == current_level->sim_point_index + 1) && !current_circuit_is_inspected_subcircuit)
+    if ((view.tests[view.test_index].sim_points.size() == view.sim_point_index + 1) && !current_circuit_is_inspected_subcircuit)
     {
-        unsigned test_index = current_level->test_index;
-        int pin_index = current_level->tests[test_index].tested_direction;
-        unsigned value = current_level->tests[test_index].sim_points.back().values[pin_index];
+        unsigned test_index = view.test_index;
+        int pin_index = view.tests[test_index].tested_direction;
+        unsigned value = view.tests[test_index].sim_points.back().values[pin_index];
         XYPos num_pos;
         switch (pin_index)
         {
@@ -1414,11 +1477,11 @@ void GameState::render_grid(int scale, XYPos grid_offset)
     for (pos.y = 0; pos.y < 10; pos.y++)                        // Print pressure numbers
     for (pos.x = 0; pos.x < 9; pos.x++)
     {
-        uint8_t touched = current_circuit->touched_ns[pos.y][pos.x];
+        uint8_t touched = view.touched_ns[pos.y][pos.x];
         if (touched == 0)
             continue;
-        Pressure vented = (touched < 3) ? (current_circuit->connections_ns[pos.y][pos.x].value) : 0;
-        unsigned value = pressure_as_percent(current_circuit->connections_ns[pos.y][pos.x].value);
+        Pressure vented = (touched < 3) ? (view.connections_ns[pos.y][pos.x]) : 0;
+        unsigned value = pressure_as_percent(view.connections_ns[pos.y][pos.x]);
         if (vented > 1000)
         {
             int i = 0;
@@ -1443,11 +1506,11 @@ void GameState::render_grid(int scale, XYPos grid_offset)
     for (pos.y = 0; pos.y < 9; pos.y++)
     for (pos.x = 0; pos.x < 10; pos.x++)
     {
-        uint8_t touched = current_circuit->touched_ew[pos.y][pos.x];
+        uint8_t touched = view.touched_ew[pos.y][pos.x];
         if (touched == 0)
             continue;
-        Pressure vented = (touched < 3) ? (current_circuit->connections_ew[pos.y][pos.x].value) : 0;
-        unsigned value = pressure_as_percent(current_circuit->connections_ew[pos.y][pos.x].value);
+        Pressure vented = (touched < 3) ? (view.connections_ew[pos.y][pos.x]) : 0;
+        unsigned value = pressure_as_percent(view.connections_ew[pos.y][pos.x]);
         if (vented > 1000)
         {
             int i = 0;
@@ -1528,15 +1591,25 @@ void GameState::render_grid(int scale, XYPos grid_offset)
     }
 }
 
-void GameState::render(bool saving)
+// The part of a frame which needs the sim lock: the server replies, which can change the levels,
+// and a copy of what the simulation has reached for render to draw from once the lock is gone.
+
+void GameState::capture_view()
 {
     if ((frame_index % 100) == 0)
         check_clipboard();
     deal_with_scores();
     deal_with_server_levels_from_server();
     deal_with_paste_from_server();
+    if (mouse_state == MOUSE_STATE_PASTING_CLIPBOARD)
+        clipboard.elaborate(level_set);
     current_circuit->render_prep();
+    view.capture(*current_level, *current_circuit);
+    view_game_speed = game_speed;
+}
 
+void GameState::render(bool saving)
+{
     SDL_RenderClear(sdl_renderer);
     XYPos window_size;
     SDL_GetWindowSize(sdl_window, &window_size.x, &window_size.y);
@@ -1555,7 +1628,7 @@ void GameState::render(bool saving)
     frame_index++;
     debug_frames++;
     
-    if (edited_level_set->levels[highest_level]->best_score && (highest_level + 1) < LEVEL_COUNT)
+    if (view.get_best_score(*edited_level_set->levels[highest_level]) && (highest_level + 1) < LEVEL_COUNT)
     {
         highest_level++;
         level_win_animation = 100;
@@ -1830,7 +1903,6 @@ void GameState::render(bool saving)
     }
     else if (mouse_state == MOUSE_STATE_PASTING_CLIPBOARD)
     {
-        clipboard.elaborate(level_set);
         XYPos mouse_grid = ((mouse - grid_offset) / scale) / 32;
         
         mouse_grid.x = std::max(std::min(mouse_grid.x, 9 - clipboard.size().x), 0);
@@ -2018,11 +2090,11 @@ void GameState::render(bool saving)
             render_texture(src_rect, dst_rect);
 
             src_rect = {624, 16, 16, 16};
-            dst_rect = {(8 + 32 * 11 + 32 * 5 + int(game_speed)) * scale, (8 + 8) * scale, 16 * scale, 16 * scale};
+            dst_rect = {(8 + 32 * 11 + 32 * 5 + int(view_game_speed)) * scale, (8 + 8) * scale, 16 * scale, 16 * scale};
             render_texture(src_rect, dst_rect);
         }
         {                                                                                               // Current Score
-            render_number_2digit(XYPos((8 + 32 * 11 + 32 * 4 + 3) * scale, (8 + 8) * scale), pressure_as_percent(current_level->best_score), 3*scale);
+            render_number_2digit(XYPos((8 + 32 * 11 + 32 * 4 + 3) * scale, (8 + 8) * scale), pressure_as_percent(view.best_score), 3*scale);
         }
         {                                                                                               // Help Button
             unsigned highlight = show_help;
@@ -2062,18 +2134,18 @@ void GameState::render(bool saving)
             switch (test_mode)
             {
                 case TEST_MODE_ACCURACY:
-                    render_score_2digit_err(XYPos((pos.x * 32 + 32 - 9 - 4) * scale + panel_offset.x, (pos.y * 32 + 4) * scale + panel_offset.y), level_set->levels[level_index]->best_score, scale);
+                    render_score_2digit_err(XYPos((pos.x * 32 + 32 - 9 - 4) * scale + panel_offset.x, (pos.y * 32 + 4) * scale + panel_offset.y), view.get_best_score(*level_set->levels[level_index]), scale);
                     break;
                 case TEST_MODE_PRICE:
                 {
                     SDL_Rect src_rect = {144, 160, 5, 5};
-                    SDL_Rect dst_rect = {(pos.x * 32 + 32 - 8 - render_number_long_get_width(level_set->levels[level_index]->best_price)) * scale + panel_offset.x, (pos.y * 32 + 4) * scale + panel_offset.y, 5 * scale, 5 * scale};
+                    SDL_Rect dst_rect = {(pos.x * 32 + 32 - 8 - render_number_long_get_width(view.get_best_price(*level_set->levels[level_index]))) * scale + panel_offset.x, (pos.y * 32 + 4) * scale + panel_offset.y, 5 * scale, 5 * scale};
                     render_texture(src_rect, dst_rect);
-                    render_number_long(XYPos((pos.x * 32 + 32 - 4 - render_number_long_get_width(level_set->levels[level_index]->best_price)) * scale + panel_offset.x, (pos.y * 32 + 4) * scale + panel_offset.y), level_set->levels[level_index]->best_price, scale);
+                    render_number_long(XYPos((pos.x * 32 + 32 - 4 - render_number_long_get_width(view.get_best_price(*level_set->levels[level_index]))) * scale + panel_offset.x, (pos.y * 32 + 4) * scale + panel_offset.y), view.get_best_price(*level_set->levels[level_index]), scale);
                     break;
                 }
                 case TEST_MODE_STEAM:
-                    render_number_compact(XYPos((pos.x * 32 + 32 - 4 - render_number_compact_get_width(level_set->levels[level_index]->best_steam)) * scale + panel_offset.x, (pos.y * 32 + 4) * scale + panel_offset.y), level_set->levels[level_index]->best_steam, scale);
+                    render_number_compact(XYPos((pos.x * 32 + 32 - 4 - render_number_compact_get_width(view.get_best_steam(*level_set->levels[level_index]))) * scale + panel_offset.x, (pos.y * 32 + 4) * scale + panel_offset.y), view.get_best_steam(*level_set->levels[level_index]), scale);
                     break;
             }
         }
@@ -2316,33 +2388,33 @@ void GameState::render(bool saving)
             
             {
                 SDL_Rect src_rect = {256 + 80 + (port_index * 6 * 16) , 16, 16, 16};
-                SDL_Rect dst_rect = {(port_index * 48 + 8) * scale + panel_offset.x, (101 - int(current_level->current_simpoint.values[port_index])) * scale + panel_offset.y, 16 * scale, 16 * scale};
+                SDL_Rect dst_rect = {(port_index * 48 + 8) * scale + panel_offset.x, (101 - int(view.current_simpoint.values[port_index])) * scale + panel_offset.y, 16 * scale, 16 * scale};
                 render_texture(src_rect, dst_rect);
             }
-            render_number_2digit(XYPos((port_index * 48 + 8 + 3 ) * scale + panel_offset.x, ((101 - current_level->current_simpoint.values[port_index]) + 5) * scale + panel_offset.y), current_level->current_simpoint.values[port_index], scale);
+            render_number_2digit(XYPos((port_index * 48 + 8 + 3 ) * scale + panel_offset.x, ((101 - view.current_simpoint.values[port_index]) + 5) * scale + panel_offset.y), view.current_simpoint.values[port_index], scale);
             
             {
                 SDL_Rect src_rect = {256 + 80 + (port_index * 6 * 16) , 16, 16, 16};
-                SDL_Rect dst_rect = {(port_index * 48 + int(current_level->current_simpoint.force[port_index])/ 3) * scale + panel_offset.x, (101 + 16 + 7) * scale + panel_offset.y, 16 * scale, 16 * scale};
+                SDL_Rect dst_rect = {(port_index * 48 + int(view.current_simpoint.force[port_index])/ 3) * scale + panel_offset.x, (101 + 16 + 7) * scale + panel_offset.y, 16 * scale, 16 * scale};
                 render_texture(src_rect, dst_rect);
             }
-            render_number_2digit(XYPos((port_index * 48 + 3 + int(current_level->current_simpoint.force[port_index])/ 3) * scale + panel_offset.x, (101 + 16 + 7 + 5) * scale + panel_offset.y), current_level->current_simpoint.force[port_index], scale);
+            render_number_2digit(XYPos((port_index * 48 + 3 + int(view.current_simpoint.force[port_index])/ 3) * scale + panel_offset.x, (101 + 16 + 7 + 5) * scale + panel_offset.y), view.current_simpoint.force[port_index], scale);
 
-            //render_number_2digit(XYPos((port_index * 48 + current_level->current_simpoint.force[port_index] + 3) * scale + panel_offset.x, (101 + 16 + 7 + 5) * scale + panel_offset.y), current_level->current_simpoint.force[port_index]*3);
+            //render_number_2digit(XYPos((port_index * 48 + view.current_simpoint.force[port_index] + 3) * scale + panel_offset.x, (101 + 16 + 7 + 5) * scale + panel_offset.y), view.current_simpoint.force[port_index]*3);
             
-            render_number_pressure(XYPos((port_index * 48 + 8 + (number_high_precision ? 2 : 6)) * scale + panel_offset.x, (101 + 16 + 20 + 5) * scale + panel_offset.y), current_level->ports[port_index].value, scale);
+            render_number_pressure(XYPos((port_index * 48 + 8 + (number_high_precision ? 2 : 6)) * scale + panel_offset.x, (101 + 16 + 20 + 5) * scale + panel_offset.y), view.ports[port_index], scale);
 
             
         }
     }
     else if (panel_state == PANEL_STATE_MONITOR)
     {
-        unsigned test_index = current_level->test_index;
-        unsigned test_count = current_level->tests.size();
+        unsigned test_index = view.test_index;
+        unsigned test_count = view.tests.size();
         pos = XYPos(0,0);
-        render_button(XYPos(panel_offset.x + 0 * 32 * scale, panel_offset.y), XYPos(448 + 0 * 24, 176), current_level->monitor_state == MONITOR_STATE_PAUSE, "Stop tests");
-        render_button(XYPos(panel_offset.x + 1 * 32 * scale, panel_offset.y), XYPos(448 + 1 * 24, 176), current_level->monitor_state == MONITOR_STATE_PLAY_1, "Repeat 1 test");
-        render_button(XYPos(panel_offset.x + 2 * 32 * scale, panel_offset.y), XYPos(448 + 2 * 24, 176), current_level->monitor_state == MONITOR_STATE_PLAY_ALL, "Run all tests");
+        render_button(XYPos(panel_offset.x + 0 * 32 * scale, panel_offset.y), XYPos(448 + 0 * 24, 176), view.monitor_state == MONITOR_STATE_PAUSE, "Stop tests");
+        render_button(XYPos(panel_offset.x + 1 * 32 * scale, panel_offset.y), XYPos(448 + 1 * 24, 176), view.monitor_state == MONITOR_STATE_PLAY_1, "Repeat 1 test");
+        render_button(XYPos(panel_offset.x + 2 * 32 * scale, panel_offset.y), XYPos(448 + 2 * 24, 176), view.monitor_state == MONITOR_STATE_PLAY_ALL, "Run all tests");
         
         if ((next_dialogue_level > version_reindex_level(0,8)) && !current_level_set_is_inspected)
         {
@@ -2361,7 +2433,7 @@ void GameState::render(bool saving)
                     tooltip_string = "Save";
                 src_rect.y += 32;
                 dst_rect.y -= 16 * scale;
-                if (current_level->saved_designs[i])                     // restore stars star
+                if (view.saved_designs[i])                     // restore stars star
                 {
                     render_texture(src_rect, dst_rect);
                     if (((mouse - XYPos(dst_rect.x, dst_rect.y))/scale).inside(XYPos(16,16)))
@@ -2372,7 +2444,7 @@ void GameState::render(bool saving)
 
 
 
-        if (current_level->best_design)                     // Little star
+        if (view.best_design)                     // Little star
         {
             SDL_Rect src_rect = {336, 32, 16, 16};
             SDL_Rect dst_rect = {panel_offset.x + (0) * scale, panel_offset.y + (32 + 8 + 16) * scale, 16 * scale, 16 * scale};
@@ -2387,12 +2459,12 @@ void GameState::render(bool saving)
             SDL_Rect src_rect = {272, 16, 16, 16};
             if (i == test_index)
                 src_rect.x = 368;
-            else if (i < test_index && current_level->monitor_state == MONITOR_STATE_PLAY_ALL && !current_level->touched)
+            else if (i < test_index && view.monitor_state == MONITOR_STATE_PLAY_ALL && !view.touched)
                 src_rect.x = 368;
             SDL_Rect dst_rect = {panel_offset.x + (16 + i * 16) * scale, panel_offset.y + (32 + 8) * scale, 16 * scale, 16 * scale};
             render_texture(src_rect, dst_rect);
-            render_score_2digit_err(XYPos(panel_offset.x + (16 + i * 16 + 3) * scale, panel_offset.y + (32 + 8 + 5) * scale), current_level->tests[i].last_score, scale);
-            render_score_2digit_err(XYPos(panel_offset.x + (16 + i * 16 + 3) * scale, panel_offset.y + (32 + 8 + 16 + 5) * scale), current_level->tests[i].best_score, scale);
+            render_score_2digit_err(XYPos(panel_offset.x + (16 + i * 16 + 3) * scale, panel_offset.y + (32 + 8 + 5) * scale), view.tests[i].last_score, scale);
+            render_score_2digit_err(XYPos(panel_offset.x + (16 + i * 16 + 3) * scale, panel_offset.y + (32 + 8 + 16 + 5) * scale), view.tests[i].best_score, scale);
         }
 
         if (editing_level)
@@ -2406,8 +2478,8 @@ void GameState::render(bool saving)
             switch (test_mode)
             {
                 case TEST_MODE_ACCURACY:
-                    render_number_pressure(XYPos(panel_offset.x + (16 + test_count * 16 + 3) * scale, panel_offset.y + (32 + 8 + 5) * scale), current_level->last_score, scale);
-                    render_number_pressure(XYPos(panel_offset.x + (16 + test_count * 16 + 3) * scale, panel_offset.y + (32 + 8 + 16 + 5) * scale), current_level->best_score, scale);
+                    render_number_pressure(XYPos(panel_offset.x + (16 + test_count * 16 + 3) * scale, panel_offset.y + (32 + 8 + 5) * scale), view.last_score, scale);
+                    render_number_pressure(XYPos(panel_offset.x + (16 + test_count * 16 + 3) * scale, panel_offset.y + (32 + 8 + 16 + 5) * scale), view.best_score, scale);
                     break;
                 case TEST_MODE_PRICE:
                     {
@@ -2415,24 +2487,24 @@ void GameState::render(bool saving)
                         SDL_Rect dst_rect = {panel_offset.x + int(16 + test_count * 16 + 3) * scale, panel_offset.y + (32 + 8 + 5) * scale, 5 * scale, 5 * scale};
                         render_texture(src_rect, dst_rect);
 
-                        render_number_long(XYPos(panel_offset.x + (16 + test_count * 16 + 3 + 5) * scale, panel_offset.y + (32 + 8 + 5) * scale), current_level->last_price, scale);
+                        render_number_long(XYPos(panel_offset.x + (16 + test_count * 16 + 3 + 5) * scale, panel_offset.y + (32 + 8 + 5) * scale), view.last_price, scale);
 
                         dst_rect = {panel_offset.x + int(16 + test_count * 16 + 3) * scale, panel_offset.y + (32 + 8 + 16 + 5) * scale, 5 * scale, 5 * scale};
                         render_texture(src_rect, dst_rect);
-                        render_number_long(XYPos(panel_offset.x + (16 + test_count * 16 + 3 + 5) * scale, panel_offset.y + (32 + 8 + 16 + 5) * scale), current_level->best_price, scale);
+                        render_number_long(XYPos(panel_offset.x + (16 + test_count * 16 + 3 + 5) * scale, panel_offset.y + (32 + 8 + 16 + 5) * scale), view.best_price, scale);
                     }
                     break;
                 case TEST_MODE_STEAM:
                     {
-                        render_number_compact(XYPos(panel_offset.x + (16 + test_count * 16 + 3 + 5) * scale, panel_offset.y + (32 + 8 + 5) * scale), current_level->last_steam, scale);
-                        render_number_compact(XYPos(panel_offset.x + (16 + test_count * 16 + 3 + 5) * scale, panel_offset.y + (32 + 8 + 16 + 5) * scale), current_level->best_steam, scale);
+                        render_number_compact(XYPos(panel_offset.x + (16 + test_count * 16 + 3 + 5) * scale, panel_offset.y + (32 + 8 + 5) * scale), view.last_steam, scale);
+                        render_number_compact(XYPos(panel_offset.x + (16 + test_count * 16 + 3 + 5) * scale, panel_offset.y + (32 + 8 + 16 + 5) * scale), view.best_steam, scale);
                     }
                     break;
             }
         }
 
-        int sim_point_count = current_level->tests[test_index].sim_points.size();
-        int sim_point_index = current_level->sim_point_index;
+        int sim_point_count = view.tests[test_index].sim_points.size();
+        int sim_point_index = view.sim_point_index;
         int sim_point_offset = std::max(std::min(sim_point_count - 12, sim_point_index - 6), 0);
 
         render_box(XYPos(panel_offset.x, panel_offset.y + (32 + 32 + 8) * scale), XYPos(8*32, 112), 4, scale);
@@ -2459,15 +2531,15 @@ void GameState::render(bool saving)
         for (int i = 0; i < 4; i++)                 // Inputs
         {
             int pin_index = current_level->pin_order[i];
-            if ((pin_index >= 0) && (pin_index != current_level->tests[test_index].tested_direction))
+            if ((pin_index >= 0) && (pin_index != view.tests[test_index].tested_direction))
             {
                 SDL_Rect src_rect = {256 + pin_index * 16, 144, 16, 16};
                 SDL_Rect dst_rect = {panel_offset.x + 8 * scale, y_pos, 16 * scale, 16 * scale};
                 render_texture(src_rect, dst_rect);
                 for (int i2 = sim_point_offset; (i2 < sim_point_count) && (i2 < (sim_point_offset + 12)); i2++)
                 {
-                    unsigned value = current_level->tests[test_index].sim_points[i2].values[pin_index];
-                    render_number_2digit(XYPos(panel_offset.x + (8 + 16 + 3 + (i2 - sim_point_offset) * 16) * scale, y_pos + (5) * scale), value, scale, 9, current_level->sim_point_index == i2 ? 4 : 0);
+                    unsigned value = view.tests[test_index].sim_points[i2].values[pin_index];
+                    render_number_2digit(XYPos(panel_offset.x + (8 + 16 + 3 + (i2 - sim_point_offset) * 16) * scale, y_pos + (5) * scale), value, scale, 9, view.sim_point_index == i2 ? 4 : 0);
                 }
                 y_pos += 16 * scale;
             }
@@ -2476,7 +2548,7 @@ void GameState::render(bool saving)
         {
             for (int i2 = sim_point_offset; (i2 < sim_point_count) && (i2 < (sim_point_offset + 12)); i2++)
             {
-                if (current_level->tests[test_index].first_simpoint == i2)
+                if (view.tests[test_index].first_simpoint == i2)
                 {
                     SDL_Rect src_rect = {352, 208, 16, 16};
                     SDL_Rect dst_rect = {panel_offset.x + (8 + 16 + (i2 - sim_point_offset) * 16) * scale, y_pos, 16 * scale, 16 * scale};
@@ -2493,24 +2565,24 @@ void GameState::render(bool saving)
         }
 
         {                                       // Output
-            int pin_index = current_level->tests[test_index].tested_direction;
+            int pin_index = view.tests[test_index].tested_direction;
             SDL_Rect src_rect = {256 + pin_index * 16, 144, 16, 16};
             SDL_Rect dst_rect = {panel_offset.x + 8 * scale, y_pos, 16 * scale, 16 * scale};
             render_texture(src_rect, dst_rect);
 
             for (int i2 = sim_point_offset; (i2 < sim_point_count) && (i2 < (sim_point_offset + 12)); i2++)
             {
-                unsigned force = current_level->tests[test_index].sim_points[i2].force[pin_index];
-                unsigned value = current_level->tests[test_index].sim_points[i2].values[pin_index];
+                unsigned force = view.tests[test_index].sim_points[i2].force[pin_index];
+                unsigned value = view.tests[test_index].sim_points[i2].values[pin_index];
                 if (force || (i2 == sim_point_count-1))
                 {
-                    render_number_2digit(XYPos(panel_offset.x + (8 + 16 + 3 + (i2 - sim_point_offset) * 16) * scale, y_pos + (5) * scale), value, scale, 9, current_level->sim_point_index == i2 ? 4 : (force ? 3: 0));
+                    render_number_2digit(XYPos(panel_offset.x + (8 + 16 + 3 + (i2 - sim_point_offset) * 16) * scale, y_pos + (5) * scale), value, scale, 9, view.sim_point_index == i2 ? 4 : (force ? 3: 0));
                 }
             }
             if ((sim_point_count  - sim_point_offset) <= 12)
             {
-//                unsigned value = current_level->tests[test_index].sim_points[sim_point_count-1].values[pin_index];
-//                render_number_2digit(XYPos(panel_offset.x + (8 + 16 + 3 + (sim_point_count - sim_point_offset - 1) * 16) * scale, y_pos + (5) * scale), value, 1, 9, current_level->sim_point_index == sim_point_count - 1 ? 4 : 0);
+//                unsigned value = view.tests[test_index].sim_points[sim_point_count-1].values[pin_index];
+//                render_number_2digit(XYPos(panel_offset.x + (8 + 16 + 3 + (sim_point_count - sim_point_offset - 1) * 16) * scale, y_pos + (5) * scale), value, 1, 9, view.sim_point_index == sim_point_count - 1 ? 4 : 0);
                 if (editing_level)
                 {
                     SDL_Rect src_rect = {464, 160, 8, 16};
@@ -2519,7 +2591,7 @@ void GameState::render(bool saving)
                 }
                 else
                 {
-                    render_number_pressure(XYPos(panel_offset.x + (8 + 16 + 3 + 16 + (sim_point_count - sim_point_offset - 1) * 16) * scale, y_pos + (5) * scale), current_level->tests[test_index].last_pressure_log[HISTORY_POINT_COUNT - 1] , scale, 9, 1);
+                    render_number_pressure(XYPos(panel_offset.x + (8 + 16 + 3 + 16 + (sim_point_count - sim_point_offset - 1) * 16) * scale, y_pos + (5) * scale), view.last_pressure_log[HISTORY_POINT_COUNT - 1] , scale, 9, 1);
                 }
             }
             y_pos += 16 * scale;
@@ -2527,7 +2599,7 @@ void GameState::render(bool saving)
 
         if (editing_level)
         {
-            SDL_Rect src_rect = {368 + current_level->tests[test_index].reset * 16, 208, 16, 16};
+            SDL_Rect src_rect = {368 + view.tests[test_index].reset * 16, 208, 16, 16};
             SDL_Rect dst_rect = {panel_offset.x + 156 * scale, panel_offset.y + (32 + 32 + 16) * scale, 16 * scale, 16 * scale};
             render_texture(src_rect, dst_rect);
 
@@ -2547,7 +2619,7 @@ void GameState::render(bool saving)
             dst_rect = {panel_offset.x + 108 * scale, panel_offset.y + (32 + 32 + 16 + 5) * scale, 8 * scale, 8 * scale};
             render_texture(src_rect, dst_rect);
             
-            int c = int64_t(int64_t(current_level->substep_count) * PRESSURE_SCALAR) / 10000;
+            int c = int64_t(int64_t(view.substep_count) * PRESSURE_SCALAR) / 10000;
             
             render_number_pressure(XYPos(panel_offset.x + (number_high_precision ? 54 : 71) * scale, panel_offset.y + (32 + 32 + 16 + 3) * scale), c, 2 * scale, 9, 1);
 
@@ -2615,14 +2687,14 @@ void GameState::render(bool saving)
             }
             {
                 SDL_Rect src_rect = {256 + 80 , 16, 16, 16};
-                SDL_Rect dst_rect = {panel_offset.x + (256-32-8+16) * scale, graph_pos.y + ((int)current_level->test_pressure_histroy_speed - 8) * scale, 16 * scale, 16 * scale};
+                SDL_Rect dst_rect = {panel_offset.x + (256-32-8+16) * scale, graph_pos.y + ((int)view.test_pressure_histroy_speed - 8) * scale, 16 * scale, 16 * scale};
                 render_texture(src_rect, dst_rect);
             }
             
             for (int i = 0; i < 200-1; i++)
             {
-                Level::PressureRecord& rec1 = current_level->test_pressure_histroy[(current_level->test_pressure_histroy_index + i) % 200];
-                Level::PressureRecord& rec2 = current_level->test_pressure_histroy[(current_level->test_pressure_histroy_index + i + 1) % 200];
+                Level::PressureRecord& rec1 = view.test_pressure_histroy[(view.test_pressure_histroy_index + i) % 200];
+                Level::PressureRecord& rec2 = view.test_pressure_histroy[(view.test_pressure_histroy_index + i + 1) % 200];
                 if ((rec1.values[0] >= 0)  && (rec2.values[0] >= 0))
                 {
                     if (rec1.marker)
@@ -2639,7 +2711,7 @@ void GameState::render(bool saving)
                     }
                     for (int port = 0; port < 4; port++)
                     {
-                        int myport = ((current_level->test_pressure_histroy_index + i) % 200 + port) % 4;
+                        int myport = ((view.test_pressure_histroy_index + i) % 200 + port) % 4;
                         int v1 = pressure_as_percent(rec1.values[myport]);
                         int v2 = pressure_as_percent(rec2.values[myport]);
                         int top = 100 - std::max(v1, v2);
@@ -2657,12 +2729,12 @@ void GameState::render(bool saving)
     
     if ((panel_state == PANEL_STATE_TEST && test_alt_graph)  || (panel_state == PANEL_STATE_MONITOR && !monitor_alt_graph))
     {
-        unsigned test_index = current_level->test_index;
+        unsigned test_index = view.test_index;
         render_box(XYPos(panel_offset.x, panel_offset.y + (32 + 32 + 8 + 112) * scale), XYPos(256, 120), 5, scale);
         {
             XYPos graph_pos(8 * scale + panel_offset.x, (32 + 32 + 8 + 112 + 9) * scale + panel_offset.y);
             {
-                int target_value = current_level->tests[test_index].sim_points.back().values[current_level->tests[test_index].tested_direction];
+                int target_value = view.tests[test_index].sim_points.back().values[view.tests[test_index].tested_direction];
                 int pos = 100 - target_value;
                 SDL_Rect src_rect = {503, 83, 1, 1};
                 SDL_Rect dst_rect = {graph_pos.x, (100 - target_value) * scale + graph_pos.y, (HISTORY_POINT_COUNT - 1) * scale, 1 * scale};
@@ -2678,8 +2750,8 @@ void GameState::render(bool saving)
             {
                 for (int i = 0; i < HISTORY_POINT_COUNT-1; i++)
                 {
-                    int v1 = pressure_as_percent(current_level->tests[test_index].best_pressure_log[i]);
-                    int v2 = pressure_as_percent(current_level->tests[test_index].best_pressure_log[i + 1]);
+                    int v1 = pressure_as_percent(view.best_pressure_log[i]);
+                    int v2 = pressure_as_percent(view.best_pressure_log[i + 1]);
                     int top = 100 - std::max(v1, v2);
                     int size = abs(v1 - v2) + 1;
 
@@ -2687,10 +2759,10 @@ void GameState::render(bool saving)
                     SDL_Rect dst_rect = {i * scale + graph_pos.x, top * scale + graph_pos.y, 1 * scale, size * scale};
                     render_texture(src_rect, dst_rect);
                 }
-                for (int i = 0; i < int(current_level->tests[test_index].last_pressure_index) - 1; i++)
+                for (int i = 0; i < int(view.last_pressure_index) - 1; i++)
                 {
-                    int v1 = pressure_as_percent(current_level->tests[test_index].last_pressure_log[i]);
-                    int v2 = pressure_as_percent(current_level->tests[test_index].last_pressure_log[i + 1]);
+                    int v1 = pressure_as_percent(view.last_pressure_log[i]);
+                    int v2 = pressure_as_percent(view.last_pressure_log[i + 1]);
                     int top = 100 - std::max(v1, v2);
                     int size = abs(v1 - v2) + 1;
 
@@ -3295,7 +3367,12 @@ void GameState::render(bool saving)
         SDL_Rect dst_rect = {0,0, 24 * scale, 24 * scale};
         render_texture(src_rect, dst_rect);
     }
+}
 
+// Kept out of render so the sim lock is not held while waiting for the display
+
+void GameState::present()
+{
     SDL_RenderPresent(sdl_renderer);
 }
 
@@ -4250,6 +4327,7 @@ void GameState::mouse_click_in_panel(unsigned clicks)
                     SDL_Rect dst_rect = {0, 0, 360, 360};
                     screen_offset = XYPos(0,0);
                     render_texture(src_rect, dst_rect);
+                    view.capture(*current_level, *current_circuit);
                     render_grid(1, XYPos(32,32));
                     
                     uint32_t pixel_data[360 * 360];
@@ -12,6 +12,9 @@
 #include <map>
 #include <list>
 #include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
 
 struct ServerResp
 {
@@ -160,6 +163,13 @@ public:
     unsigned late_frames = 0;
     unsigned time_last_progress = 0;
 
+    std::thread sim_thread;
+    std::mutex sim_mutex;                   // held by the sim thread while it runs a slice and by the main thread until capture_view
+    std::atomic<bool> sim_waiting = false;  // the main thread wants the lock, the sim thread lets it in between slices
+    std::atomic<bool> sim_quit = false;
+    LevelView view;                         // what render draws of the running level, see capture_view
+    unsigned view_game_speed = 20;
+
     unsigned slider_pos;
     Direction slider_direction;
     unsigned slider_max;
@@ -319,8 +329,15 @@ public:
     void update_scale(int ewscale);
     void form_custom_icon(CircuitElement& element);
     void render_grid(int scale, XYPos grid_offset);
+    void capture_view();
     void render(bool saving = false);
+    void present();
     void advance();
+    void start_sim();
+    void stop_sim();
+    void sim_loop();
+    void lock_sim();
+    void unlock_sim();
     void set_level(int level_index);
     void set_level(std::string name);
     void click_scroll_bar(ScrollBar& sbar, XYPos mouse_click);
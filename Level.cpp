@@ -6,12 +6,15 @@
 #include <fstream>
 #include <algorithm>
 #include <limits>
+#include <climits>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
 #include <sstream>
 #include <codecvt>
+#include <thread>
+#include <atomic>
 
 static SaveObjectList* make_level_desc()
 {
@@ -24,6 +27,11 @@ static SaveObjectList* make_level_desc()
 
 SaveObjectList* level_desc = make_level_desc();
 
+bool Level::record_graph = true;
+bool Level::fast_forward_cycles = true;
+bool Level::reuse_presets = true;
+bool Level::run_bursts = true;
+
 Test::Test()
 {
         for (int i = 0; i < HISTORY_POINT_COUNT; i++)
@@ -142,6 +150,48 @@ SaveObject* Test::save(bool custom, bool lite)
     return omap;
 }
 
+SimSnapshot::SimSnapshot(SaveObject* sobj)
+{
+    SaveObjectMap* omap = sobj->get_map();
+    signature = omap->get_num("signature");
+    SaveObjectList* slist = omap->get_item("state")->get_list();
+    for (unsigned i = 0; i < slist->get_count(); i++)
+        state.push_back(slist->get_num(i));
+    slist = omap->get_item("ports")->get_list();
+    for (int i = 0; i < 4; i++)
+        ports[i] = slist->get_num(i);
+    steam = omap->get_num("steam");
+    test_index = omap->get_num("test_index");
+    sim_point_index = omap->get_num("sim_point_index");
+    substep_index = omap->get_num("substep_index");
+    slist = omap->get_item("test_scores")->get_list();
+    for (unsigned i = 0; i < slist->get_count(); i++)
+        test_scores.push_back(slist->get_num(i));
+}
+
+SaveObject* SimSnapshot::save()
+{
+    SaveObjectMap* omap = new SaveObjectMap;
+    omap->add_num("signature", signature);
+    SaveObjectList* slist = new SaveObjectList;
+    for (Pressure p : state)
+        slist->add_num(p);
+    omap->add_item("state", slist);
+    slist = new SaveObjectList;
+    for (int i = 0; i < 4; i++)
+        slist->add_num(ports[i]);
+    omap->add_item("ports", slist);
+    omap->add_num("steam", steam);
+    omap->add_num("test_index", test_index);
+    omap->add_num("sim_point_index", sim_point_index);
+    omap->add_num("substep_index", substep_index);
+    slist = new SaveObjectList;
+    for (Pressure p : test_scores)
+        slist->add_num(p);
+    omap->add_item("test_scores", slist);
+    return omap;
+}
+
 Level::Level(int level_index_, bool hidden_):
     level_index(level_index_),
     hidden(hidden_)
@@ -177,6 +227,23 @@ Level::Level(int level_index_, SaveObject* sobj, unsigned version, bool inspecte
     init_tests(omap);
 }
 
+// Only the tests [first_test, last_test) are copied, renumbered from 0. Cached presets record
+// the test they were taken on, so they are renumbered with it.
+
+Level::Level(Level& other, Circuit* circuit_, unsigned first_test, unsigned last_test):
+    level_index(other.level_index),
+    circuit(circuit_),
+    connection_mask(other.connection_mask),
+    substep_count(other.substep_count),
+    tests(other.tests.begin() + first_test, other.tests.begin() + last_test)
+{
+    for (Test& test : tests)
+    {
+        if (test.preset_valid)
+            test.preset.test_index -= first_test;
+    }
+}
+
 Level::~Level()
 {
     delete circuit;
@@ -504,6 +571,7 @@ void Level::re_init_tests(SaveObjectMap* desc)
 {
         substep_count = desc->get_num("substep_count");
         tests.clear();
+        preset_running = false;
         SaveObjectList* testlist = desc->get_item("tests")->get_list();
         for (unsigned i = 0; i < testlist->get_count(); i++)
         {
@@ -529,43 +597,307 @@ void Level::reset()
         ports[i] = 0;
     last_price = circuit->get_cost();
     circuit->reset_steam_used();
+    preset_running = false;
 }
 
-void Level::advance(unsigned ticks)
+void Level::log_pressure(Pressure value)
 {
-    unsigned test_pressure_histroy_sample_interval = pow(1.05, test_pressure_histroy_speed) * 10;
-
-    circuit->prep(PressureAdjacent(ports[0], ports[1], ports[2], ports[3]));
+    Test& test = tests[test_index];
+    if (sim_point_index == test.sim_points.size() - 1)
+    {
+        unsigned index = (substep_index * HISTORY_POINT_COUNT) / substep_count;
+        test.last_pressure_log[index] = value;
+        test.last_pressure_index = index + 1;
+    }
+}
 
-    static int val = 0;
-    for (int tick = 0; tick < ticks; tick++)
+void Level::record_history(const Pressure values[4], unsigned sample_interval)
+{
+    if (!record_graph)
+        return;
+    if ((test_pressure_histroy_sample_counter % 10000) == 0)
+    {
+        test_pressure_histroy[test_pressure_histroy_index].marker = 1;
+    }
+    
+    if ((test_pressure_histroy_sample_counter % sample_interval) == 0)
     {
         for (int p = 0; p < 4; p++)
-            ports[p].pre();
+            test_pressure_histroy[test_pressure_histroy_index].values[p] = values[p];
+        test_pressure_histroy_index = (test_pressure_histroy_index + 1) % 200;
+        test_pressure_histroy[test_pressure_histroy_index].marker = 0;
+
+    }
+    test_pressure_histroy_sample_counter++;
+}
+
+// The number of ticks before the next one which record_history has to see
+
+unsigned Level::history_gap(unsigned sample_interval)
+{
+    if (!record_graph)
+        return UINT_MAX;
+    unsigned sample = (sample_interval - test_pressure_histroy_sample_counter % sample_interval) % sample_interval;
+    unsigned marker = (10000 - test_pressure_histroy_sample_counter % 10000) % 10000;
+    return std::min(sample, marker);
+}
+
+// The number of ticks before the last one of the current log_pressure slot, the one whose
+// pressure the slot ends up with. Only the last sim point of a test is logged.
+
+unsigned Level::log_gap()
+{
+    if (sim_point_index != tests[test_index].sim_points.size() - 1)
+        return UINT_MAX;
+    uint64_t index = (uint64_t(substep_index) * HISTORY_POINT_COUNT) / substep_count;
+    uint64_t last = ((index + 1) * substep_count + HISTORY_POINT_COUNT - 1) / HISTORY_POINT_COUNT - 1;
+    return std::min<uint64_t>(last, substep_count - 1) - substep_index;
+}
+
+void Level::sim_tick()
+{
+    sim_ticks++;
+    for (int p = 0; p < 4; p++)
+        ports[p].pre();
+
+    for (int p = 0; p < 4; p++)
+    {
+        if ((((connection_mask >> p) & 1)) || (monitor_state == MONITOR_STATE_PAUSE))
+            ports[p].apply(current_simpoint.values[p], current_simpoint.force[p]);
+    }
+    circuit->sim_pre(PressureAdjacent(ports[0], ports[1], ports[2], ports[3]));
 
+    for (int p = 0; p < 4; p++)
+        ports[p].post();
+    if (port_trace)
+    {
+        Pressure values[4];
         for (int p = 0; p < 4; p++)
+            values[p] = ports[p].value;
+        trace_tick(values);
+    }
+}
+
+// Preset ticks jumped over by a snapshot are traced just before the tick after them, so a run
+// which ends with a jump does not trace ticks it never reached.
+
+void Level::trace_tick(const Pressure values[4])
+{
+    if (pending_trace)
+    {
+        for (size_t i = 0; i < pending_trace->size(); i += 4)
+            port_trace->add(pending_trace->data() + i);
+        pending_trace = NULL;
+    }
+    port_trace->add(values);
+    if (preset_running)
+    {
+        std::vector<Pressure>& preset_trace = tests[test_index].preset_trace;
+        preset_trace.insert(preset_trace.end(), values, values + 4);
+    }
+}
+
+void Level::start_cycle()
+{
+    circuit->fast_sim.save_state(cycle_start_state);
+    for (int p = 0; p < 4; p++)
+        cycle_start_ports[p] = ports[p].value;
+    cycle_start_steam = circuit->fast_sim.get_steam_used_raw();
+    cycle_ticks = 0;
+    cycle_record.resize(FAST_FORWARD_WINDOW);
+}
+
+// A window carries over between calls to advance only if nothing touched the simulation in
+// between, otherwise the recorded ports would not belong to a single run of the circuit.
+
+void Level::pause_cycle()
+{
+    circuit->fast_sim.save_state(cycle_pause_state);
+    for (int p = 0; p < 4; p++)
+        cycle_pause_ports[p] = ports[p].value;
+    cycle_pause_position[0] = monitor_state;
+    cycle_pause_position[1] = test_index;
+    cycle_pause_position[2] = sim_point_index;
+    cycle_pause_position[3] = substep_index;
+}
+
+bool Level::resume_cycle()
+{
+    if (cycle_pause_position[0] != monitor_state || cycle_pause_position[1] != test_index ||
+        cycle_pause_position[2] != sim_point_index || cycle_pause_position[3] != substep_index)
+        return false;
+    for (int p = 0; p < 4; p++)
+        if (ports[p].value != cycle_pause_ports[p])
+            return false;
+    return circuit->fast_sim.state_equal(cycle_pause_state);
+}
+
+// Called after every tick which stayed within the sim point. The state is compared against the one
+// at the start of the window and, if it matches, the circuit is in a fixed point or a cycle of
+// that many ticks. Whole cycles can then be skipped by replaying the recorded port pressures and
+// multiplying the steam used. The tick that crosses into the next sim point is always simulated.
+// Windows which find no cycle within FAST_FORWARD_WINDOW ticks are restarted. Returns the number
+// of ticks skipped.
+
+unsigned Level::fast_forward(unsigned max_ticks, unsigned sample_interval)
+{
+    if (!fast_forward_cycles)
+        return 0;
+    for (int p = 0; p < 4; p++)
+        cycle_record[cycle_ticks].ports[p] = ports[p].value;
+    cycle_ticks++;
+
+    bool same = true;
+    for (int p = 0; p < 4; p++)
+        same = same && (ports[p].value == cycle_start_ports[p]);
+    same = same && circuit->fast_sim.state_equal(cycle_start_state);
+    if (!same)
+    {
+        if (cycle_ticks == FAST_FORWARD_WINDOW)
+            start_cycle();
+        return 0;
+    }
+
+    unsigned cycles = std::min(max_ticks, substep_count - substep_index - 1) / cycle_ticks;
+    unsigned skipped = cycles * cycle_ticks;
+    circuit->fast_sim.add_steam_used((circuit->fast_sim.get_steam_used_raw() - cycle_start_steam) * cycles);
+    if (!port_trace && log_gap() == UINT_MAX && history_gap(sample_interval) == UINT_MAX)
+        substep_index += skipped;
+    else
+    {
+        for (unsigned i = 0; i < skipped; i++)
         {
-            if ((((connection_mask >> p) & 1)) || (monitor_state == MONITOR_STATE_PAUSE))
-                ports[p].apply(current_simpoint.values[p], current_simpoint.force[p]);
+            CycleRecord& record = cycle_record[i % cycle_ticks];
+            if (port_trace)
+                trace_tick(record.ports);
+            log_pressure(record.ports[tests[test_index].tested_direction]);
+            substep_index++;
+            record_history(record.ports, sample_interval);
         }
-        circuit->sim_pre(PressureAdjacent(ports[0], ports[1], ports[2], ports[3]));
+    }
+    start_cycle();
+    return skipped;
+}
 
-        for (int p = 0; p < 4; p++)
-            ports[p].post();
+void Level::save_snapshot(SimSnapshot& snapshot)
+{
+    snapshot.signature = circuit->fast_sim.get_signature();
+    circuit->fast_sim.save_state(snapshot.state);
+    for (int p = 0; p < 4; p++)
+        snapshot.ports[p] = ports[p].value;
+    snapshot.steam = circuit->fast_sim.get_steam_used_raw();
+    snapshot.test_index = test_index;
+    snapshot.sim_point_index = sim_point_index;
+    snapshot.substep_index = substep_index;
+    snapshot.test_scores.clear();
+    for (Test& test : tests)
+        snapshot.test_scores.push_back(test.last_score);
+}
+
+// Fails, leaving the level untouched, unless the circuit compiles to the same layout as the one
+// the snapshot was taken from. Test scores are only restored if the snapshot has them.
+
+bool Level::restore_snapshot(SimSnapshot& snapshot)
+{
+    if (snapshot.test_index >= tests.size() || snapshot.sim_point_index >= tests[snapshot.test_index].sim_points.size())
+        return false;
+    circuit->prep(PressureAdjacent(ports[0], ports[1], ports[2], ports[3]));
+    if (circuit->fast_sim.get_signature() != snapshot.signature || !circuit->fast_sim.load_state(snapshot.state))
+        return false;
+    for (int p = 0; p < 4; p++)
+    {
+        ports[p].clear();
+        ports[p].value = snapshot.ports[p];
+    }
+    circuit->reset_steam_used();
+    circuit->fast_sim.add_steam_used(snapshot.steam);
+    test_index = snapshot.test_index;
+    sim_point_index = snapshot.sim_point_index;
+    substep_index = snapshot.substep_index;
+    current_simpoint = tests[test_index].sim_points[sim_point_index];
+    if (snapshot.test_scores.size() == tests.size())
+    {
+        for (unsigned t = 0; t < tests.size(); t++)
+            tests[t].last_score = snapshot.test_scores[t];
+    }
+    return true;
+}
+
+// Called whenever a test starts from a reset circuit at its first sim point. The preset points
+// always play out the same way, so after the first run their end state is kept and jumped to.
+// Any tick in between which is not part of that run (a pause, an edit) abandons the recording.
+// The game draws the preset phase and its pressure graph, so only headless users jump over it.
+
+void Level::start_preset()
+{
+    preset_running = false;
+    Test& test = tests[test_index];
+    if (!reuse_presets || record_graph || sim_point_index || !test.first_simpoint)
+        return;
+    int64_t steam = circuit->fast_sim.get_steam_used_raw();
+    bool traced = !port_trace || !test.preset_trace.empty();     // a traced run must be able to replay the ticks it skips
+    if (test.preset_valid && traced && restore_snapshot(test.preset))
+    {
+        circuit->fast_sim.add_steam_used(steam);
+        if (port_trace)
+            pending_trace = &test.preset_trace;
+        return;
+    }
+    test.preset_valid = false;
+    test.preset_trace.clear();
+    preset_running = true;
+    preset_start_steam = steam;
+}
 
-        if (sim_point_index == tests[test_index].sim_points.size() - 1)
+void Level::advance(unsigned ticks)
+{
+    unsigned test_pressure_histroy_sample_interval = pow(1.05, test_pressure_histroy_speed) * 10;
+
+    bool rebuilt = !circuit->fast_prepped;
+    circuit->prep(PressureAdjacent(ports[0], ports[1], ports[2], ports[3]));
+    if (rebuilt || !resume_cycle())
+        start_cycle();
+
+    unsigned tick = 0;
+    while (tick < ticks)
+    {
+        // Ticks which stay within the sim point and have nothing to log or record run in a burst,
+        // up to the next one that does. The last tick of the call is never part of a burst, so
+        // the logs are up to date when it returns.
+
+        if (monitor_state != MONITOR_STATE_PAUSE && run_bursts)
         {
-            Pressure value = ports[tests[test_index].tested_direction].value;
-            unsigned index = (substep_index * HISTORY_POINT_COUNT) / substep_count;
-            tests[test_index].last_pressure_log[index] = value;
-            tests[test_index].last_pressure_index = index + 1;
+            unsigned burst = std::min({ticks - tick - 1, substep_count - substep_index - 1,
+                                       history_gap(test_pressure_histroy_sample_interval), log_gap()});
+            unsigned skipped = 0;
+            unsigned run = 0;
+            while (run < burst && !skipped)
+            {
+                sim_tick();
+                substep_index++;
+                test_pressure_histroy_sample_counter++;
+                run++;
+                skipped = fast_forward(ticks - tick - run, test_pressure_histroy_sample_interval);
+            }
+            tick += run + skipped;
+            if (skipped || tick == ticks)
+                continue;
         }
 
+        if (monitor_state == MONITOR_STATE_PAUSE)
+            preset_running = false;
+
+        sim_tick();
+
+        log_pressure(ports[tests[test_index].tested_direction].value);
+
+        bool sim_point_changed = false;
         if (monitor_state != MONITOR_STATE_PAUSE)
         {
             substep_index++;
             if (substep_index >= substep_count)
             {
+                sim_point_changed = true;
                 substep_index  = 0;
                 if (sim_point_index == tests[test_index].sim_points.size() - 1)
                 {
@@ -595,6 +927,7 @@ void Level::advance(unsigned ticks)
                         circuit->reset();
                         for (int i = 0; i < 4; i++)
                             ports[i] = 0;
+                        start_preset();
                     }
                 }
                 else
@@ -602,23 +935,307 @@ void Level::advance(unsigned ticks)
                     sim_point_index++;
                 }
                 current_simpoint = tests[test_index].sim_points[sim_point_index];
+                if (preset_running && sim_point_index == tests[test_index].first_simpoint)
+                {
+                    Test& test = tests[test_index];
+                    save_snapshot(test.preset);
+                    test.preset.steam -= preset_start_steam;
+                    test.preset.test_scores.clear();
+                    test.preset_valid = true;
+                    preset_running = false;
+                }
             }
         }
 
-        if ((test_pressure_histroy_sample_counter % 10000) == 0)
+        Pressure values[4];
+        for (int p = 0; p < 4; p++)
+            values[p] = ports[p].value;
+        record_history(values, test_pressure_histroy_sample_interval);
+
+        if (monitor_state != MONITOR_STATE_PAUSE)
         {
-            test_pressure_histroy[test_pressure_histroy_index].marker = 1;
+            if (sim_point_changed)
+                start_cycle();
+            else
+                tick += fast_forward(ticks - tick - 1, test_pressure_histroy_sample_interval);
         }
-        
-        if ((test_pressure_histroy_sample_counter % test_pressure_histroy_sample_interval) == 0)
+        tick++;
+    }
+    pause_cycle();
+    circuit->store_pressures();
+}
+
+// Runs tests [first, last) as MONITOR_STATE_PLAY_ALL would, on a copy of the level using the
+// given circuit. The first test must start from a reset circuit, so the results match a
+// sequential run.
+
+void Level::run_test_segment(Circuit* segment_circuit, unsigned first, unsigned last, PortTrace* trace)
+{
+    Level segment(*this, segment_circuit, first, last);
+    segment.port_trace = trace;
+
+    // The segment ends by moving on to the test after it, which always starts with a reset.
+    // After the last test that is a copy of test 0 marked as a reset, which stops the copy from
+    // wrapping around into a new run and clearing the steam used. Its preset is never run.
+
+    segment.tests.push_back(last < tests.size() ? tests[last] : tests[0]);
+    Test& next = segment.tests.back();
+    next.preset = SimSnapshot();
+    next.preset_valid = false;
+    if (last == tests.size())
+    {
+        next.reset = RESET_ALL;
+        next.first_simpoint = 0;
+    }
+
+    unsigned ticks = 0;
+    for (unsigned t = first; t < last; t++)
+        ticks += (tests[t].sim_points.size() - (t ? tests[t].first_simpoint : 0)) * substep_count;
+
+    segment.test_index = 0;
+    segment.sim_point_index = first ? tests[first].first_simpoint : 0;
+    segment.substep_index = 0;
+    segment.current_simpoint = tests[first].sim_points[segment.sim_point_index];
+    segment_circuit->reset();
+    segment_circuit->reset_steam_used();
+    segment.advance(ticks);
+
+    for (unsigned t = first; t < last; t++)
+    {
+        Test& result = segment.tests[t - first];
+        tests[t].last_score = result.last_score;
+        tests[t].last_pressure_index = result.last_pressure_index;
+        for (int i = 0; i < HISTORY_POINT_COUNT; i++)
+            tests[t].last_pressure_log[i] = result.last_pressure_log[i];
+    }
+    segment.circuit = NULL;
+}
+
+// Tests which begin with a full reset do not depend on the ones before them. Each such run
+// of tests is simulated on its own copy of the circuit and the results merged back as if the
+// level had been played through with MONITOR_STATE_PLAY_ALL. Returns false if there is
+// nothing to split, leaving the level untouched.
+
+bool Level::advance_parallel(unsigned thread_count)
+{
+    std::vector<unsigned> segment_start;
+    for (unsigned t = 0; t < tests.size(); t++)
+    {
+        if (t == 0 || tests[t].reset == RESET_ALL)
+            segment_start.push_back(t);
+    }
+    unsigned segment_count = segment_start.size();
+    if (segment_count < 2 || thread_count < 2)
+        return false;
+    segment_start.push_back(tests.size());
+
+    std::vector<Circuit*> segment_circuits(segment_count, NULL);
+    std::vector<PortTrace> segment_traces(port_trace ? segment_count : 0);
+    for (PortTrace& trace : segment_traces)
+        trace.keep = true;
+    std::atomic<unsigned> next_segment = 0;
+    auto worker = [&]()
+    {
+        while (true)
+        {
+            unsigned segment = next_segment++;
+            if (segment >= segment_count)
+                return;
+            segment_circuits[segment] = new Circuit(*circuit);
+            run_test_segment(segment_circuits[segment], segment_start[segment], segment_start[segment + 1],
+                             port_trace ? &segment_traces[segment] : NULL);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < std::min(thread_count, segment_count); i++)
+        threads.push_back(std::thread(worker));
+    for (std::thread& thread : threads)
+        thread.join();
+
+    circuit->reset_steam_used();
+    for (Circuit* segment_circuit : segment_circuits)
+    {
+        circuit->add_steam_used(*segment_circuit);
+        delete segment_circuit;
+    }
+    for (PortTrace& trace : segment_traces)
+    {
+        for (size_t i = 0; i < trace.values.size(); i += 4)
+            port_trace->add(trace.values.data() + i);
+    }
+    if (!touched)
+        update_score(true);
+    reset();
+    return true;
+}
+
+LevelLanes::~LevelLanes()
+{
+    for (Lane* lane : lanes)
+        delete lane;
+}
+
+// Designs can only share a lane schedule if their levels run the same tests
+
+bool LevelLanes::fits(Level& other)
+{
+    if (other.substep_count != level.substep_count || other.connection_mask != level.connection_mask)
+        return false;
+    if (other.tests.size() != level.tests.size())
+        return false;
+    for (unsigned t = 0; t < level.tests.size(); t++)
+    {
+        Test& a = level.tests[t];
+        Test& b = other.tests[t];
+        if (a.tested_direction != b.tested_direction || a.first_simpoint != b.first_simpoint || a.reset != b.reset)
+            return false;
+        if (a.sim_points.size() != b.sim_points.size())
+            return false;
+        for (unsigned i = 0; i < a.sim_points.size(); i++)
         {
             for (int p = 0; p < 4; p++)
-                test_pressure_histroy[test_pressure_histroy_index].values[p] = ports[p].value;
-            test_pressure_histroy_index = (test_pressure_histroy_index + 1) % 200;
-            test_pressure_histroy[test_pressure_histroy_index].marker = 0;
+            {
+                if (a.sim_points[i].values[p] != b.sim_points[i].values[p] || a.sim_points[i].force[p] != b.sim_points[i].force[p])
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+unsigned LevelLanes::add(Circuit* circuit)
+{
+    lanes.push_back(new Lane(circuit));
+    return lanes.size() - 1;
+}
+
+void LevelLanes::Lane::tick(SimPoint& sim_point, unsigned connection_mask)
+{
+    for (int p = 0; p < 4; p++)
+        ports[p].pre();
+    for (int p = 0; p < 4; p++)
+    {
+        if ((connection_mask >> p) & 1)
+            ports[p].apply(sim_point.values[p], sim_point.force[p]);
+    }
+    circuit->sim_pre(adj());
+    for (int p = 0; p < 4; p++)
+        ports[p].post();
+}
 
+void LevelLanes::Lane::start_cycle()
+{
+    circuit->fast_sim.save_state(cycle_start_state);
+    for (int p = 0; p < 4; p++)
+        cycle_start_ports[p] = ports[p].value;
+    cycle_start_steam = circuit->fast_sim.get_steam_used_raw();
+    cycle_ticks = 0;
+}
+
+bool LevelLanes::Lane::find_cycle()
+{
+    cycle_ticks++;
+    for (int p = 0; p < 4; p++)
+    {
+        if (ports[p].value != cycle_start_ports[p])
+        {
+            if (cycle_ticks == FAST_FORWARD_WINDOW)
+                start_cycle();
+            return false;
         }
-        test_pressure_histroy_sample_counter++;
+    }
+    if (!circuit->fast_sim.state_equal(cycle_start_state))
+    {
+        if (cycle_ticks == FAST_FORWARD_WINDOW)
+            start_cycle();
+        return false;
+    }
+    return true;
+}
+
+// The lane repeats every cycle_ticks ticks, so the whole cycles in what is left of the sim point
+// only add steam and the remainder is simulated.
+
+void LevelLanes::Lane::finish(SimPoint& sim_point, unsigned connection_mask, unsigned ticks)
+{
+    unsigned cycles = ticks / cycle_ticks;
+    circuit->fast_sim.add_steam_used((circuit->fast_sim.get_steam_used_raw() - cycle_start_steam) * cycles);
+    for (unsigned i = cycles * cycle_ticks; i < ticks; i++)
+        tick(sim_point, connection_mask);
+}
+
+void LevelLanes::run()
+{
+    for (Lane* lane : lanes)
+    {
+        lane->circuit->reset();
+        lane->circuit->reset_steam_used();
+        for (int p = 0; p < 4; p++)
+            lane->ports[p] = 0;
+        lane->circuit->prep(lane->adj());
+        lane->test_scores.assign(level.tests.size(), 0);
+        lane->price = lane->circuit->get_cost();
+    }
+
+    std::vector<Lane*> running;
+    for (unsigned t = 0; t < level.tests.size(); t++)
+    {
+        Test& test = level.tests[t];
+        if (t && test.reset == RESET_ALL)
+        {
+            for (Lane* lane : lanes)
+            {
+                lane->circuit->reset();
+                for (int p = 0; p < 4; p++)
+                    lane->ports[p] = 0;
+            }
+        }
+
+        for (unsigned s = t ? test.first_simpoint : 0; s < test.sim_points.size(); s++)
+        {
+            SimPoint& sim_point = test.sim_points[s];
+            running = lanes;
+            for (Lane* lane : running)
+                lane->start_cycle();
+            for (unsigned tick = 0; tick < level.substep_count && !running.empty(); tick++)
+            {
+                for (Lane* lane : running)
+                    lane->tick(sim_point, level.connection_mask);
+                unsigned left = level.substep_count - tick - 1;
+                for (unsigned i = 0; i < running.size();)
+                {
+                    Lane* lane = running[i];
+                    if (left && lane->find_cycle())
+                    {
+                        lane->finish(sim_point, level.connection_mask, left);
+                        running[i] = running.back();
+                        running.pop_back();
+                    }
+                    else
+                        i++;
+                }
+            }
+        }
+
+        Direction p = test.tested_direction;
+        Pressure target = percent_as_pressure(test.sim_points.back().values[p]);
+        for (Lane* lane : lanes)
+        {
+            Pressure score = percent_as_pressure(100) - abs(target - lane->ports[p].value) * (100 / 5);
+            if (score < 0)
+                score = 0;
+            lane->test_scores[t] = score;
+        }
+    }
+
+    for (Lane* lane : lanes)
+    {
+        lane->score = percent_as_pressure(100);
+        for (Pressure score : lane->test_scores)
+            lane->score = std::min(lane->score, score);
+        lane->steam = lane->circuit->get_steam_used();
+        lane->circuit->store_pressures();
     }
 }
 
@@ -632,13 +1249,14 @@ void Level::select_test(unsigned t)
     touched = true;
     substep_index = 0;
     set_monitor_state(MONITOR_STATE_PLAY_1);
+    preset_running = false;
     if (tests[test_index].reset || test_index == 0)
     {
         circuit->reset();
         for (int i = 0; i < 4; i++)
             ports[i] = 0;
+        start_preset();
     }
-
 }
 
 void Level::update_score(bool fin)
@@ -695,6 +1313,7 @@ void Level::set_monitor_state(TestExecType monitor_state_)
         circuit->reset();
         for (int i = 0; i < 4; i++)
             ports[i] = 0;
+        start_preset();
     }
     current_simpoint = tests[test_index].sim_points[sim_point_index];
 }
@@ -702,6 +1321,9 @@ void Level::set_monitor_state(TestExecType monitor_state_)
 void Level::touch()
 {
     touched = true;
+    preset_running = false;
+    for (Test& test : tests)
+        test.preset_valid = false;
     score_set = false;
     circuit->fast_prepped = false;
     last_price = circuit->get_cost();
@@ -721,6 +1343,57 @@ void Level::set_best_design(LevelSet* new_best)
     }
 }
 
+void LevelView::capture(Level& level, Circuit& circuit)
+{
+    captured = &level;
+    test_index = level.test_index;
+    sim_point_index = level.sim_point_index;
+    current_simpoint = level.current_simpoint;
+    for (int i = 0; i < 4; i++)
+        ports[i] = level.ports[i].value;
+    monitor_state = level.monitor_state;
+    touched = level.touched;
+
+    best_score = level.best_score;
+    last_score = level.last_score;
+    best_price = level.best_price;
+    last_price = level.last_price;
+    best_steam = level.best_steam;
+    last_steam = level.last_steam;
+    substep_count = level.substep_count;
+    best_design = level.best_design;
+    for (int i = 0; i < 4; i++)
+        saved_designs[i] = level.saved_designs[i];
+
+    tests.resize(level.tests.size());
+    for (unsigned t = 0; t < tests.size(); t++)
+    {
+        tests[t].last_score = level.tests[t].last_score;
+        tests[t].best_score = level.tests[t].best_score;
+        tests[t].tested_direction = level.tests[t].tested_direction;
+        tests[t].first_simpoint = level.tests[t].first_simpoint;
+        tests[t].reset = level.tests[t].reset;
+        tests[t].sim_points = level.tests[t].sim_points;
+    }
+    Test& test = level.tests[test_index];
+    std::copy(test.best_pressure_log, test.best_pressure_log + HISTORY_POINT_COUNT, best_pressure_log);
+    std::copy(test.last_pressure_log, test.last_pressure_log + HISTORY_POINT_COUNT, last_pressure_log);
+    last_pressure_index = test.last_pressure_index;
+
+    std::copy(level.test_pressure_histroy, level.test_pressure_histroy + 200, test_pressure_histroy);
+    test_pressure_histroy_index = level.test_pressure_histroy_index;
+    test_pressure_histroy_speed = level.test_pressure_histroy_speed;
+
+    for (int y = 0; y < 10; y++)
+    for (int x = 0; x < 10; x++)
+    {
+        connections_ns[y][x] = circuit.connections_ns[y][x].value;
+        connections_ew[y][x] = circuit.connections_ew[y][x].value;
+        touched_ns[y][x] = circuit.touched_ns[y][x];
+        touched_ew[y][x] = circuit.touched_ew[y][x];
+    }
+}
+
 LevelSet::LevelSet(SaveObject* sobj, unsigned version, bool inspect)
 {
     read_only = inspect;
@@ -770,6 +1443,23 @@ LevelSet::~LevelSet()
         {
             delete levels[i];
         }
+        for (auto& templ : subcircuit_templates)
+            delete templ.second;
+}
+
+// One elaborated copy of a level's circuit is shared by every instance of it. The elaboration
+// depends on which levels enclose it, as those are cut to stop recursion, so that is part of the key.
+
+Circuit* LevelSet::get_subcircuit_template(int level_index, std::set<unsigned>& seen)
+{
+    std::pair<int, std::set<unsigned>> key(level_index, seen);
+    auto it = subcircuit_templates.find(key);
+    if (it != subcircuit_templates.end())
+        return it->second;
+    Circuit* circuit = new Circuit(*levels[level_index]->circuit);
+    subcircuit_templates[key] = circuit;
+    circuit->elaborate(this, seen);
+    return circuit;
 }
 
 SaveObject* LevelSet::save_all(int level_index, bool lite)
@@ -823,10 +1513,12 @@ int LevelSet::top_playable(int highest_level)
     return highest_level;
 }
 
-Pressure LevelSet::test_level(int level_index)
+Pressure LevelSet::test_level(int level_index, unsigned thread_count)
 {
     reset(level_index);
     levels[level_index]->set_monitor_state(MONITOR_STATE_PLAY_ALL);
+    if (thread_count > 1)
+        levels[level_index]->advance_parallel(thread_count);
     while (!levels[level_index]->score_set)
         levels[level_index]->advance(1000);
     return levels[level_index]->last_score;
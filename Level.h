@@ -3,10 +3,12 @@
 #include "SaveState.h"
 #include "Circuit.h"
 #include <stdlib.h>
+#include <map>
 
 
 #define LEVEL_COUNT 43
 #define HISTORY_POINT_COUNT 200
+#define FAST_FORWARD_WINDOW 120
 
 #ifndef CHARLES_ID
 #define CHARLES_ID 0
@@ -60,6 +62,48 @@ enum TestResetType
     RESET_ALL
 };
 
+// Everything needed to carry on simulating a level from where it left off: the compiled circuit's
+// pressures, the ports, the steam used, the position within the tests and the test scores so far.
+// It can only be restored into a circuit which compiles to the same layout, see FastSim::get_signature.
+
+class SimSnapshot
+{
+public:
+    uint64_t signature = 0;
+    std::vector<Pressure> state;
+    Pressure ports[4] = {0, 0, 0, 0};
+    int64_t steam = 0;
+    unsigned test_index = 0;
+    unsigned sim_point_index = 0;
+    unsigned substep_index = 0;
+    std::vector<Pressure> test_scores;
+
+    SimSnapshot() {}
+    SimSnapshot(SaveObject* sobj);
+    SaveObject* save();
+};
+
+// The port pressures after every tick a level plays, whether simulated, fast forwarded or jumped
+// over by a preset snapshot. Two sim engines agree on a design when their traces are the same.
+
+class PortTrace
+{
+public:
+    uint64_t ticks = 0;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    bool keep = false;                  // keep the pressures themselves, not just the hash
+    std::vector<Pressure> values;
+
+    void add(const Pressure ports[4])
+    {
+        for (int p = 0; p < 4; p++)
+            hash = (hash ^ uint32_t(ports[p])) * 0x100000001b3ull;
+        if (keep)
+            values.insert(values.end(), ports, ports + 4);
+        ticks++;
+    }
+};
+
 class Test
 {
 public:
@@ -74,6 +118,10 @@ public:
     Pressure last_pressure_log[HISTORY_POINT_COUNT];
     unsigned last_pressure_index;
 
+    SimSnapshot preset;                 // state at first_simpoint after running the preset points from a reset
+    bool preset_valid = false;
+    std::vector<Pressure> preset_trace; // port pressures of the preset ticks, only recorded while traced
+
     Test();
     void load(SaveObjectMap* player_map, SaveObjectMap* test_map);
     SaveObject* save(bool custom, bool lite);
@@ -166,6 +214,7 @@ public:
     unsigned test_index = 0;
     unsigned sim_point_index = 0;
     unsigned substep_index = 0;
+    uint64_t sim_ticks = 0;             // ticks actually simulated, fast forwarded ones are not counted
 
     class PressureRecord
     {
@@ -176,6 +225,30 @@ public:
     int test_pressure_histroy_index = 0;
     int test_pressure_histroy_sample_counter = 0;
     unsigned test_pressure_histroy_speed = 50;
+    static bool record_graph;           // the pressure graph is only drawn by the game, headless users turn it off
+    static bool fast_forward_cycles;    // skip whole cycles once the circuit repeats itself, see fast_forward
+    static bool reuse_presets;          // jump over preset points already played once, headless only, see start_preset
+    static bool run_bursts;             // run ticks with nothing to log in a tight loop, see advance
+
+    class CycleRecord
+    {
+    public:
+        Pressure ports[4];
+    };
+    std::vector<CycleRecord> cycle_record;
+    std::vector<Pressure> cycle_start_state;
+    Pressure cycle_start_ports[4];
+    int64_t cycle_start_steam = 0;
+    unsigned cycle_ticks = 0;
+    std::vector<Pressure> cycle_pause_state;
+    Pressure cycle_pause_ports[4];
+    unsigned cycle_pause_position[4] = {~0u, ~0u, ~0u, ~0u};
+
+    bool preset_running = false;
+    int64_t preset_start_steam = 0;
+
+    PortTrace* port_trace = NULL;       // not carried over to copies, parallel segments get their own
+    const std::vector<Pressure>* pending_trace = NULL;  // preset ticks jumped over, traced before the next tick
 
     class FriendScore
     {
@@ -195,6 +268,7 @@ public:
 
     Level(int level_index_, SaveObject* sobj, unsigned version, bool inspected);
     Level(int level_index_, bool hidden_ = false);
+    Level(Level& other, Circuit* circuit_, unsigned first_test, unsigned last_test);
     ~Level();
     SaveObject* save(bool lite = false);
 
@@ -206,7 +280,22 @@ public:
     void init_tests(SaveObjectMap* omap = NULL);
     void re_init_tests(SaveObjectMap* desc);
     void reset();
+    void log_pressure(Pressure value);
+    void record_history(const Pressure values[4], unsigned sample_interval);
+    unsigned history_gap(unsigned sample_interval);
+    unsigned log_gap();
+    void sim_tick();
+    void trace_tick(const Pressure values[4]);
+    void start_cycle();
+    void pause_cycle();
+    bool resume_cycle();
+    unsigned fast_forward(unsigned max_ticks, unsigned sample_interval);
+    void save_snapshot(SimSnapshot& snapshot);
+    bool restore_snapshot(SimSnapshot& snapshot);
+    void start_preset();
     void advance(unsigned ticks);
+    void run_test_segment(Circuit* segment_circuit, unsigned first, unsigned last, PortTrace* trace);
+    bool advance_parallel(unsigned thread_count);
     void select_test(unsigned t);
 
     void update_score(bool fin);
@@ -215,12 +304,116 @@ public:
     void set_best_design(LevelSet* best);
 };
 
+// What the game draws of a running level, copied under the sim lock at the start of each frame so
+// the frame can be drawn while the sim thread carries on. Only the parts the simulation changes
+// are here: the tests, sim points and circuit layout only change on the main thread.
+
+class LevelView
+{
+public:
+    class TestView
+    {
+    public:
+        Pressure last_score = 0;
+        Pressure best_score = 0;
+        Direction tested_direction = DIRECTION_E;
+        unsigned first_simpoint = 0;
+        TestResetType reset = RESET_NONE;
+        std::vector<SimPoint> sim_points;
+    };
+
+    Level* captured = NULL;             // no other level is simulated, so the rest can be read directly
+    unsigned test_index = 0;
+    unsigned sim_point_index = 0;
+    SimPoint current_simpoint;
+    Pressure ports[4] = {0, 0, 0, 0};
+    TestExecType monitor_state = MONITOR_STATE_PLAY_ALL;
+    bool touched = false;
+
+    Pressure best_score = 0;
+    Pressure last_score = 0;
+    unsigned best_price = 0;
+    unsigned last_price = 0;
+    unsigned best_steam = 0;
+    unsigned last_steam = 0;
+    unsigned substep_count = 0;
+    bool best_design = false;           // whether there is one, the designs are not copied
+    bool saved_designs[4] = {};
+
+    std::vector<TestView> tests;
+    Pressure best_pressure_log[HISTORY_POINT_COUNT];    // of the current test
+    Pressure last_pressure_log[HISTORY_POINT_COUNT];
+    unsigned last_pressure_index = 0;
+
+    Level::PressureRecord test_pressure_histroy[200];
+    int test_pressure_histroy_index = 0;
+    unsigned test_pressure_histroy_speed = 50;
+
+    Pressure connections_ns[10][10];    // of the circuit on screen, which may be a subcircuit of the level's
+    Pressure connections_ew[10][10];
+    uint8_t touched_ns[10][10];
+    uint8_t touched_ew[10][10];
+
+    void capture(Level& level, Circuit& circuit);
+    Pressure get_best_score(Level& other) {return &other == captured ? best_score : other.best_score;}
+    unsigned get_best_price(Level& other) {return &other == captured ? best_price : other.best_price;}
+    unsigned get_best_steam(Level& other) {return &other == captured ? best_steam : other.best_steam;}
+};
+
+// Scores many designs for the same level in lockstep. The tests, sim points and port inputs
+// come from one Level and are shared by every lane, each lane only brings its own circuit.
+// A lane which settles into a fixed point or cycle finishes its sim point on its own and sits
+// out the rest of it. Results match LevelSet::test_level.
+
+class LevelLanes
+{
+public:
+    class Lane
+    {
+    public:
+        Circuit* circuit;
+        CircuitPressure ports[4];
+        bool running = false;
+
+        std::vector<Pressure> cycle_start_state;
+        Pressure cycle_start_ports[4];
+        int64_t cycle_start_steam = 0;
+        unsigned cycle_ticks = 0;
+
+        std::vector<Pressure> test_scores;
+        Pressure score = 0;
+        unsigned price = 0;
+        unsigned steam = 0;
+
+        Lane(Circuit* circuit_):
+            circuit(circuit_)
+        {}
+        PressureAdjacent adj() {return PressureAdjacent(ports[0], ports[1], ports[2], ports[3]);}
+        void tick(SimPoint& sim_point, unsigned connection_mask);
+        void start_cycle();
+        bool find_cycle();
+        void finish(SimPoint& sim_point, unsigned connection_mask, unsigned ticks);
+    };
+
+    Level& level;
+    std::vector<Lane*> lanes;
+
+    LevelLanes(Level& level_):
+        level(level_)
+    {}
+    ~LevelLanes();
+    bool fits(Level& other);
+    unsigned add(Circuit* circuit);
+    void run();
+};
 
 class LevelSet
 {
 public:
     std::vector<Level*> levels;
     bool read_only = false;
+    bool share_subcircuits = false;     // headless only, the designs must not be edited once elaborated
+    std::map<std::pair<int, std::set<unsigned>>, Circuit*> subcircuit_templates;
     LevelSet(SaveObject* sobj, unsigned version, bool inspect = false);
     LevelSet();
     ~LevelSet();
@@ -228,7 +421,7 @@ public:
     SaveObject* save_one(int level_index);
     bool is_playable(unsigned level, unsigned highest_level);
     int top_playable(int highest_level);
-    Pressure test_level(int level_index);
+    Pressure test_level(int level_index, unsigned thread_count = 1);
     void record_best_score(int level_index);
     void save_design(int level_index, unsigned save_slot);
     void reset(int level_index);
@@ -239,6 +432,7 @@ public:
     int find_custom_by_name(std::string name);
     void delete_level(int level_index);
     int find_level(int level_index, std::string name);
+    Circuit* get_subcircuit_template(int level_index, std::set<unsigned>& seen);
 };
 
 inline bool is_version_level(unsigned version, int level_index)
@@ -163,12 +163,17 @@ void mainloop()
 #endif
     int frame = 0;
     SDL_Thread *save_thread = NULL;
+    game_state->start_sim();
     
 	while(true)
 	{
         unsigned oldtime = SDL_GetTicks();
+        game_state->lock_sim();
 		if (game_state->events())
+        {
+            game_state->unlock_sim();
             break;
+        }
         game_state->advance();
         game_state->audio();
 #ifdef STEAM
@@ -176,24 +181,29 @@ void mainloop()
         SteamAPI_RunCallbacks();
 #endif
         frame++;
+        game_state->capture_view();
         if (frame > 100 * 60)
         {
-            game_state->render(true);
+            game_state->render(true);           // saving reads the levels, so this frame keeps the lock
             SaveObject* omap = game_state->save();
             SDL_WaitThread(save_thread, NULL);
             game_state->save_to_server();
             save_thread = SDL_CreateThread(save_thread_func, "save_thread", (void *)omap);
             frame = 0;
+            game_state->unlock_sim();
         }
         else
         {
+            game_state->unlock_sim();
             game_state->render();
         }
+        game_state->present();
         
         unsigned newtime = SDL_GetTicks();
         if ((newtime - oldtime) < 10)
             SDL_Delay(10 - (newtime - oldtime));
 	}
+    game_state->stop_sim();
     SDL_HideWindow(game_state->sdl_window);
     SDL_WaitThread(save_thread, NULL);
     